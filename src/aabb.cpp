@@ -1,5 +1,8 @@
 #include "aabb.h"
 
+#include <algorithm>
+#include <cmath>
+
 // TODO Remove
 #include <iostream>
 
@@ -37,6 +40,25 @@ bool AABB::intersect(const AABB& other) const {
            upper.z > other.lower.z && lower.z < other.upper.z;
 }
 
+bool AABB::intersect_ray(const glm::vec3& origin, const glm::vec3& inv_direction, float max_distance, float& entry) const {
+    entry = 0.0f;
+    float exit = max_distance;
+    for (glm::length_t i = 0; i<3; i++) {
+        // Parallel to the slabs, the ray is either always between them or never. Its distances would be
+        // 0 * inf = NaN if it starts right on one of them.
+        if (std::isinf(inv_direction[i])) {
+            if (origin[i] < lower[i] || origin[i] > upper[i]) return false;
+            continue;
+        }
+
+        float t0 = (lower[i] - origin[i]) * inv_direction[i];
+        float t1 = (upper[i] - origin[i]) * inv_direction[i];
+        entry = std::max(entry, std::min(t0, t1));
+        exit = std::min(exit, std::max(t0, t1));
+    }
+    return entry <= exit;
+}
+
 std::vector<glm::vec3> AABB::get_points() const {
     std::vector<glm::vec3> points = {
         glm::vec3(lower.x, lower.y, lower.z),
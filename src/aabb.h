@@ -15,9 +15,16 @@ struct AABB {
     AABB translate(const glm::vec3& offset) const;
 
     float volume() const { return (upper.x - lower.x) * (upper.y - lower.y) * (upper.z - lower.z); }
+    float surface_area() const {
+        glm::vec3 size = upper - lower;
+        return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+    }
+    glm::vec3 centre() const { return (lower + upper) * 0.5f; }
 
     bool contains(const AABB& other) const;
     bool intersect(const AABB& other) const;
+    // Slab test, entry is set to the distance at which the ray enters the box (0 if it starts inside)
+    bool intersect_ray(const glm::vec3& origin, const glm::vec3& inv_direction, float max_distance, float& entry) const;
 
     std::vector<glm::vec3> get_points() const;
 
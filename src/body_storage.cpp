@@ -0,0 +1,156 @@
+#include "body_storage.h"
+
+#include <cassert>
+
+#include "object.h"
+
+// Handles that outlive the storage move to detached(), which is never destroyed itself
+BodyStorage::~BodyStorage() {
+    release_all();
+}
+
+size_t BodyStorage::add(Object* object) {
+    objects.push_back(object);
+    positions.push_back(glm::vec3(0.0f));
+    orientations.push_back(glm::quat(1.0f, 0.0f, 0.0f, 0.0f));
+    linear_velocities.push_back(glm::vec3(0.0f));
+    angular_velocities.push_back(glm::vec3(0.0f));
+    split_linear_velocities.push_back(glm::vec3(0.0f));
+    split_angular_velocities.push_back(glm::vec3(0.0f));
+    inv_masses.push_back(0.0f);
+    local_inverse_inertias.push_back(glm::mat3(0.0f));
+    sleep_times.push_back(0.0f);
+    sleeping.push_back(false);
+    has_collider.push_back(false);
+    sphere_colliders.push_back(false);
+    collider_bounds.push_back(NAN_BOUNDS);
+    physics_bounds.push_back(NAN_BOUNDS);
+    rotations.push_back(glm::mat3(1.0f));
+    global_inverse_inertias.push_back(glm::mat3(0.0f));
+    rotations_outdated.push_back(false);
+    return objects.size() - 1;
+}
+
+void BodyStorage::remove(size_t i) {
+    size_t last = objects.size() - 1;
+    if (i != last) {
+        objects[i] = objects[last];
+        positions[i] = positions[last];
+        orientations[i] = orientations[last];
+        linear_velocities[i] = linear_velocities[last];
+        angular_velocities[i] = angular_velocities[last];
+        split_linear_velocities[i] = split_linear_velocities[last];
+        split_angular_velocities[i] = split_angular_velocities[last];
+        inv_masses[i] = inv_masses[last];
+        local_inverse_inertias[i] = local_inverse_inertias[last];
+        sleep_times[i] = sleep_times[last];
+        sleeping[i] = sleeping[last];
+        has_collider[i] = has_collider[last];
+        sphere_colliders[i] = sphere_colliders[last];
+        collider_bounds[i] = collider_bounds[last];
+        physics_bounds[i] = physics_bounds[last];
+        rotations[i] = rotations[last];
+        global_inverse_inertias[i] = global_inverse_inertias[last];
+        rotations_outdated[i] = rotations_outdated[last];
+        objects[i]->body = i;
+    }
+
+    objects.pop_back();
+    positions.pop_back();
+    orientations.pop_back();
+    linear_velocities.pop_back();
+    angular_velocities.pop_back();
+    split_linear_velocities.pop_back();
+    split_angular_velocities.pop_back();
+    inv_masses.pop_back();
+    local_inverse_inertias.pop_back();
+    sleep_times.pop_back();
+    sleeping.pop_back();
+    has_collider.pop_back();
+    sphere_colliders.pop_back();
+    collider_bounds.pop_back();
+    physics_bounds.pop_back();
+    rotations.pop_back();
+    global_inverse_inertias.pop_back();
+    rotations_outdated.pop_back();
+}
+
+void BodyStorage::take(Object& object) {
+    auto& from = *object.storage;
+    if (&from == this) return;
+
+    size_t j = object.body;
+    size_t i = add(&object);
+    positions[i] = from.positions[j];
+    orientations[i] = from.orientations[j];
+    linear_velocities[i] = from.linear_velocities[j];
+    angular_velocities[i] = from.angular_velocities[j];
+    split_linear_velocities[i] = from.split_linear_velocities[j];
+    split_angular_velocities[i] = from.split_angular_velocities[j];
+    inv_masses[i] = from.inv_masses[j];
+    local_inverse_inertias[i] = from.local_inverse_inertias[j];
+    sleep_times[i] = from.sleep_times[j];
+    sleeping[i] = from.sleeping[j];
+    has_collider[i] = from.has_collider[j];
+    sphere_colliders[i] = from.sphere_colliders[j];
+    collider_bounds[i] = from.collider_bounds[j];
+    physics_bounds[i] = from.physics_bounds[j];
+    rotations_outdated[i] = true;
+
+    from.remove(j);
+    object.storage = this;
+    object.body = i;
+}
+
+void BodyStorage::release_all() {
+    auto& target = detached();
+    if (this == &target) return;
+    while (!objects.empty()) {
+        target.take(*objects.back());
+    }
+}
+
+void BodyStorage::update_rotation(size_t i) {
+    rotations[i] = glm::mat3_cast(orientations[i]);
+    global_inverse_inertias[i] = rotations[i] * local_inverse_inertias[i] * glm::transpose(rotations[i]);
+    rotations_outdated[i] = false;
+}
+
+glm::mat4 BodyStorage::get_transform(size_t i) {
+    auto transform = glm::mat4(get_rotation(i));
+    transform[3] = glm::vec4(positions[i], 1.0f);
+    return transform;
+}
+
+void BodyStorage::set_collider(size_t i, const Collider* collider) {
+    has_collider[i] = collider != nullptr;
+    sphere_colliders[i] = collider && collider->is_sphere_collider();
+    collider_bounds[i] = collider ? collider->get_bounds() : NAN_BOUNDS;
+}
+
+void BodyStorage::update_bounds(size_t i) {
+    if (!has_collider[i]) return;
+    if (sphere_colliders[i]) {
+        physics_bounds[i] = collider_bounds[i].translate(positions[i]);
+    } else {
+        physics_bounds[i] = collider_bounds[i].apply_transform(get_transform(i));
+    }
+}
+
+void BodyStorage::integrate(size_t i, glm::vec3 gravity, float step_size) {
+    if (inv_masses[i] != 0.0f) {
+        linear_velocities[i] += gravity * step_size;
+    }
+
+    move(i, (linear_velocities[i] + split_linear_velocities[i]) * step_size, (angular_velocities[i] + split_angular_velocities[i]) * step_size);
+    split_linear_velocities[i] = split_angular_velocities[i] = glm::vec3(0.0f);
+}
+
+void BodyStorage::move(size_t i, glm::vec3 translation, glm::vec3 rotation) {
+    positions[i] += translation;
+    if (rotation != glm::vec3(0.0f)) {
+        orientations[i] = glm::normalize(orientations[i] + 0.5f * glm::quat(0.0f, rotation) * orientations[i]);
+        rotations_outdated[i] = true;
+    }
+    update_bounds(i);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include "aabb.h"
+
+class Object;
+class Collider;
+
+// Hot simulation state of objects, one contiguous array per member so that the phases that go over all bodies
+// (broadphase, solver, integration) only load what they use. Every Object is a handle to one entry and keeps
+// its cold data (name, shapes, collider, rendering) itself. A scene has one for its objects, objects that aren't
+// part of a scene are kept in detached(). Removing an entry moves the last one into its place.
+class BodyStorage {
+    public:
+        BodyStorage() = default;
+        BodyStorage(const BodyStorage&) = delete;
+        void operator=(const BodyStorage&) = delete;
+        ~BodyStorage();
+
+        // Never destroyed, objects can outlive any static (e.g. those of a global scene's controller)
+        static BodyStorage& detached() {
+            static BodyStorage* instance = new BodyStorage;
+            return *instance;
+        }
+
+        size_t size() const { return objects.size(); }
+
+        // Moves the object's state over from the storage it is in
+        void take(Object&);
+        // Moves all objects over to detached()
+        void release_all();
+
+        bool is_static(size_t i) const { return inv_masses[i] == 0.0f && local_inverse_inertias[i] == glm::mat3(0.0f); }
+
+        // Derived from the orientation when first needed after it changed (not thread safe for one body)
+        const glm::mat3& get_rotation(size_t i) {
+            if (rotations_outdated[i]) update_rotation(i);
+            return rotations[i];
+        }
+        const glm::mat3& get_global_inverse_inertia(size_t i) {
+            if (rotations_outdated[i]) update_rotation(i);
+            return global_inverse_inertias[i];
+        }
+        glm::mat4 get_transform(size_t i);
+
+        void set_collider(size_t i, const Collider*);
+        void update_bounds(size_t i);
+
+        // Applies gravity and moves the body by its velocities (and split velocities, which are used up) over the step
+        void integrate(size_t i, glm::vec3 gravity, float step_size);
+        // Rotation is axis times angle, about the position. First order, dq = 0.5 * (0, rotation) * q
+        void move(size_t i, glm::vec3 translation, glm::vec3 rotation);
+
+        std::vector<Object*> objects; // Handle of every entry
+        std::vector<glm::vec3> positions;
+        std::vector<glm::quat> orientations; // Local space to global space
+        std::vector<glm::vec3> linear_velocities;
+        std::vector<glm::vec3> angular_velocities;
+        // Added to the velocities for the next update only, from the solver's position correction
+        std::vector<glm::vec3> split_linear_velocities;
+        std::vector<glm::vec3> split_angular_velocities;
+        std::vector<float> inv_masses;
+        std::vector<glm::mat3> local_inverse_inertias;
+        std::vector<float> sleep_times; // How long the body has been nearly still
+        // Set by the scene for the bodies of sleeping islands, which aren't moved. Flags are bytes rather than
+        // vector<bool> so that different bodies can be written from several threads.
+        std::vector<uint8_t> sleeping;
+
+        std::vector<uint8_t> has_collider;
+        std::vector<uint8_t> sphere_colliders; // Their bounds only follow the position
+        std::vector<AABB> collider_bounds;     // Local space
+        std::vector<AABB> physics_bounds;
+
+    private:
+        std::vector<glm::mat3> rotations;
+        std::vector<glm::mat3> global_inverse_inertias;
+        std::vector<uint8_t> rotations_outdated;
+
+        size_t add(Object*);
+        void remove(size_t);
+        void update_rotation(size_t i);
+
+        friend class Object;
+};
@@ -1,6 +1,20 @@
 #include "bvh.h"
 
 #include <functional>
+#include <algorithm>
+#include <cassert>
+#include <atomic>
+#include <array>
+#include <limits>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "thread_pool.h"
+
+#undef min
+#undef max
 
 
 void RawBVHTree::add_raw_node(const AABB& bounds, void* data) {
@@ -41,7 +55,9 @@ void RawBVHTree::insert_raw_node(std::unique_ptr<BVHNode>& parent, std::unique_p
 std::vector<void*> RawBVHTree::intersect_raw(const AABB& bounds) const {
     std::vector<void*> result = {};
 
+    size_t nodes_visited = 0;
     std::function<void(BVHNode*)> visitor = [&](BVHNode* node) {
+        nodes_visited++;
         if (!node->bounds.intersect(bounds)) return;
 
         if (node->is_leaf()) {
@@ -55,10 +71,123 @@ std::vector<void*> RawBVHTree::intersect_raw(const AABB& bounds) const {
     };
 
     if (root) visitor(root.get());
+    BVHQueryCounters::the().record(nodes_visited, result.size());
 
     return result;
 }
 
+void* RawBVHTree::ray_cast_raw(const glm::vec3& origin, const glm::vec3& direction, float& max_distance, const std::function<float(void*, float)>& hit_test) const {
+    if (!root) return nullptr;
+
+    const glm::vec3 inv_direction = 1.0f / direction;
+
+    float entry;
+    if (!root->bounds.intersect_ray(origin, inv_direction, max_distance, entry)) return nullptr;
+
+    void* closest = nullptr;
+    size_t nodes_visited = 0;
+    size_t leaves_tested = 0;
+    std::vector<std::pair<const BVHNode*, float>> stack = { { root.get(), entry } };
+    while (!stack.empty()) {
+        auto [node, node_entry] = stack.back();
+        stack.pop_back();
+
+        if (node_entry > max_distance) continue; // A closer hit was found after this node was queued
+        nodes_visited++;
+
+        if (node->is_leaf()) {
+            leaves_tested++;
+            float distance = hit_test(node->data, max_distance);
+            if (distance < max_distance) {
+                max_distance = distance;
+                closest = node->data;
+            }
+            continue;
+        }
+
+        float entries[2];
+        bool hits[2];
+        for (size_t i = 0; i<2; i++) {
+            hits[i] = node->children[i] && node->children[i]->bounds.intersect_ray(origin, inv_direction, max_distance, entries[i]);
+        }
+
+        // Push the far child first so that the near one is visited first
+        size_t near = (hits[0] && hits[1] && entries[1] < entries[0]) ? 1 : 0;
+        size_t far = 1 - near;
+        if (hits[far])  stack.push_back({ node->children[far].get(),  entries[far] });
+        if (hits[near]) stack.push_back({ node->children[near].get(), entries[near] });
+    }
+    BVHQueryCounters::the().record(nodes_visited, leaves_tested);
+
+    return closest;
+}
+
+size_t RawBVHTree::memory_usage() const {
+    size_t count = 0;
+    std::function<void(BVHNode*)> visitor = [&](BVHNode* node) {
+        if (!node) return;
+        count++;
+        visitor(node->children[0].get());
+        visitor(node->children[1].get());
+    };
+    visitor(root.get());
+
+    return sizeof(*this) + count * sizeof(BVHNode);
+}
+
+BVHStats RawBVHTree::compute_stats() const {
+    BVHStats stats;
+    if (!root) return stats;
+
+    const float root_area = root->bounds.surface_area();
+    std::function<void(const BVHNode*, size_t)> visitor = [&](const BVHNode* node, size_t depth) {
+        if (node->is_leaf()) {
+            stats.add_leaf(node->bounds, depth, 1, root_area);
+            return;
+        }
+
+        // Incrementally built trees can have internal nodes with a single child
+        const BVHNode* second = node->children[1] ? node->children[1].get() : node->children[0].get();
+        stats.add_node(node->bounds, node->children[0]->bounds, second->bounds, root_area);
+        for (auto& child : node->children) {
+            if (child) visitor(child.get(), depth + 1);
+        }
+    };
+    visitor(root.get(), 0);
+
+    stats.finish();
+    return stats;
+}
+
+void BVHStats::add_node(const AABB& bounds, const AABB& child_a, const AABB& child_b, float root_area) {
+    node_count++;
+    sah_cost += RawBVHTree::SAH_NODE_COST * bounds.surface_area() / root_area;
+
+    float area = bounds.surface_area();
+    if (child_a.intersect(child_b) && area > 0.0f) {
+        AABB overlap(glm::max(child_a.lower, child_b.lower), glm::min(child_a.upper, child_b.upper));
+        sibling_overlap += overlap.surface_area() / area;
+    }
+}
+
+void BVHStats::add_leaf(const AABB& bounds, size_t depth, size_t primitives, float root_area) {
+    node_count++;
+    leaf_count++;
+    primitive_count += primitives;
+    max_depth = std::max(max_depth, depth);
+    sah_cost += RawBVHTree::SAH_LEAF_COST * primitives * bounds.surface_area() / root_area;
+
+    if (depth_histogram.size() <= depth) depth_histogram.resize(depth + 1);
+    depth_histogram[depth]++;
+    if (leaf_size_histogram.size() <= primitives) leaf_size_histogram.resize(primitives + 1);
+    leaf_size_histogram[primitives]++;
+}
+
+void BVHStats::finish() {
+    size_t internal_count = node_count - leaf_count;
+    if (internal_count > 0) sibling_overlap /= internal_count;
+}
+
 void RawBVHTree::debug_draw() const {
     std::function<void(BVHNode*)> visitor = [&](BVHNode* node) {
         if (!node) return;  
@@ -70,4 +199,323 @@ void RawBVHTree::debug_draw() const {
     };
 
     visitor(root.get());
-}
\ No newline at end of file
+}
+
+namespace {
+    const uint32_t INVALID_INDEX = std::numeric_limits<uint32_t>::max();
+
+    const float SAH_NODE_COST = RawBVHTree::SAH_NODE_COST;
+    const float SAH_LEAF_COST = RawBVHTree::SAH_LEAF_COST;
+    const size_t MAX_TREELET_LEAVES = 7;
+
+    // Flattened node used during the bulk build. Internal nodes occupy [0, n-1) and leaves [n-1, 2n-1)
+    struct LinearNode {
+        AABB bounds = NAN_BOUNDS;
+        uint32_t children[2] = { INVALID_INDEX, INVALID_INDEX };
+        uint32_t parent = INVALID_INDEX;
+        uint32_t leaf_count = 1;
+        float cost = 0.0f;
+    };
+
+    int count_leading_zeros(uint32_t value) {
+        if (value == 0) return 32;
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanReverse(&index, value);
+        return 31 - (int)index;
+#else
+        return __builtin_clz(value);
+#endif
+    }
+
+    // Spreads the lower 10 bits out so that there are two zero bits between each of them
+    uint32_t expand_bits(uint32_t v) {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    uint32_t morton_code(glm::vec3 p) {
+        p = glm::min(glm::max(p * 1024.0f, glm::vec3(0.0f)), glm::vec3(1023.0f));
+        return (expand_bits((uint32_t)p.x) << 2) | (expand_bits((uint32_t)p.y) << 1) | expand_bits((uint32_t)p.z);
+    }
+
+    // Stable LSD radix sort of the codes, with the leaf indices carried along
+    void radix_sort(std::vector<uint32_t>& keys, std::vector<uint32_t>& values) {
+        auto& pool = ThreadPool::the();
+        const size_t count = keys.size();
+        const size_t chunk_count = std::max((size_t)1, std::min(pool.size() * 4, count / 4096));
+        const size_t chunk_size = (count + chunk_count - 1) / chunk_count;
+
+        std::vector<uint32_t> keys_out(count);
+        std::vector<uint32_t> values_out(count);
+        std::vector<std::array<size_t, 256>> offsets(chunk_count);
+
+        for (uint32_t shift = 0; shift<32; shift += 8) {
+            pool.parallel_for(chunk_count, 1, [&](size_t begin, size_t end) {
+                for (size_t chunk = begin; chunk<end; chunk++) {
+                    auto& histogram = offsets[chunk];
+                    histogram.fill(0);
+                    for (size_t i = chunk * chunk_size; i<std::min(count, (chunk + 1) * chunk_size); i++) {
+                        histogram[(keys[i] >> shift) & 0xFF]++;
+                    }
+                }
+            });
+
+            size_t total = 0;
+            for (size_t digit = 0; digit<256; digit++) {
+                for (size_t chunk = 0; chunk<chunk_count; chunk++) {
+                    size_t bucket = offsets[chunk][digit];
+                    offsets[chunk][digit] = total;
+                    total += bucket;
+                }
+            }
+
+            pool.parallel_for(chunk_count, 1, [&](size_t begin, size_t end) {
+                for (size_t chunk = begin; chunk<end; chunk++) {
+                    auto& offset = offsets[chunk];
+                    for (size_t i = chunk * chunk_size; i<std::min(count, (chunk + 1) * chunk_size); i++) {
+                        size_t target = offset[(keys[i] >> shift) & 0xFF]++;
+                        keys_out[target] = keys[i];
+                        values_out[target] = values[i];
+                    }
+                }
+            });
+
+            keys.swap(keys_out);
+            values.swap(values_out);
+        }
+    }
+
+    // Length of the common prefix of two sorted keys, with the index used as a tie breaker for duplicate codes
+    int common_prefix(const std::vector<uint32_t>& codes, int64_t i, int64_t j) {
+        if (j < 0 || j >= (int64_t)codes.size()) return -1;
+        if (codes[i] == codes[j]) return 32 + count_leading_zeros((uint32_t)(i ^ j));
+        return count_leading_zeros(codes[i] ^ codes[j]);
+    }
+
+    // Finds the children of internal node i, as described in
+    // "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees" (Karras 2012)
+    void build_internal_node(std::vector<LinearNode>& nodes, const std::vector<uint32_t>& codes, int64_t i) {
+        const int64_t leaf_offset = codes.size() - 1;
+
+        int64_t direction = common_prefix(codes, i, i + 1) - common_prefix(codes, i, i - 1) >= 0 ? 1 : -1;
+        int min_prefix = common_prefix(codes, i, i - direction);
+
+        int64_t max_length = 2;
+        while (common_prefix(codes, i, i + max_length * direction) > min_prefix) {
+            max_length *= 2;
+        }
+
+        int64_t length = 0;
+        for (int64_t step = max_length / 2; step >= 1; step /= 2) {
+            if (common_prefix(codes, i, i + (length + step) * direction) > min_prefix) {
+                length += step;
+            }
+        }
+        int64_t j = i + length * direction;
+
+        int node_prefix = common_prefix(codes, i, j);
+        int64_t split = 0;
+        for (int64_t divisor = 2;; divisor *= 2) {
+            int64_t step = (length + divisor - 1) / divisor;
+            if (common_prefix(codes, i, i + (split + step) * direction) > node_prefix) {
+                split += step;
+            }
+            if (step <= 1) break;
+        }
+        int64_t gamma = i + split * direction + std::min(direction, (int64_t)0);
+
+        uint32_t left  = (uint32_t)(std::min(i, j) == gamma     ? leaf_offset + gamma     : gamma);
+        uint32_t right = (uint32_t)(std::max(i, j) == gamma + 1 ? leaf_offset + gamma + 1 : gamma + 1);
+
+        nodes[i].children[0] = left;
+        nodes[i].children[1] = right;
+        nodes[left].parent = (uint32_t)i;
+        nodes[right].parent = (uint32_t)i;
+    }
+
+    void update_internal_node(std::vector<LinearNode>& nodes, uint32_t index) {
+        auto& node = nodes[index];
+        auto& a = nodes[node.children[0]];
+        auto& b = nodes[node.children[1]];
+
+        node.bounds = a.bounds.make_union(b.bounds);
+        node.leaf_count = a.leaf_count + b.leaf_count;
+        node.cost = SAH_NODE_COST * node.bounds.surface_area() + a.cost + b.cost;
+    }
+
+    // Rearranges the treelet below root into the topology with the lowest SAH cost,
+    // "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies" (Karras & Aila 2013)
+    void optimise_treelet(std::vector<LinearNode>& nodes, uint32_t root, uint32_t leaf_offset) {
+        std::vector<uint32_t> internals = { root };
+        std::vector<uint32_t> leaves = { nodes[root].children[0], nodes[root].children[1] };
+
+        // Grow the treelet by repeatedly opening up the leaf with the largest surface area
+        while (leaves.size() < MAX_TREELET_LEAVES) {
+            size_t best = leaves.size();
+            float best_area = -1.0f;
+            for (size_t i = 0; i<leaves.size(); i++) {
+                if (leaves[i] >= leaf_offset) continue;
+                float area = nodes[leaves[i]].bounds.surface_area();
+                if (area > best_area) {
+                    best_area = area;
+                    best = i;
+                }
+            }
+            if (best == leaves.size()) break;
+
+            uint32_t opened = leaves[best];
+            internals.push_back(opened);
+            leaves[best] = nodes[opened].children[0];
+            leaves.push_back(nodes[opened].children[1]);
+        }
+        if (leaves.size() < 3) return;
+
+        const size_t subset_count = (size_t)1 << leaves.size();
+        std::array<float, (1 << MAX_TREELET_LEAVES)> costs;
+        std::array<uint32_t, (1 << MAX_TREELET_LEAVES)> partitions;
+
+        for (size_t subset = 1; subset<subset_count; subset++) {
+            AABB bounds = NAN_BOUNDS;
+            bool first = true;
+            for (size_t i = 0; i<leaves.size(); i++) {
+                if (!(subset & ((size_t)1 << i))) continue;
+                bounds = first ? nodes[leaves[i]].bounds : bounds.make_union(nodes[leaves[i]].bounds);
+                first = false;
+            }
+
+            if ((subset & (subset - 1)) == 0) { // Single leaf
+                size_t i = 0;
+                while (!(subset & ((size_t)1 << i))) i++;
+                costs[subset] = nodes[leaves[i]].cost;
+                continue;
+            }
+
+            // Only consider partitions that keep the lowest bit on the left to skip mirrored duplicates
+            size_t lowest = subset & (~subset + 1);
+            float best = std::numeric_limits<float>::infinity();
+            uint32_t best_partition = 0;
+            for (size_t part = (subset - 1) & subset; part; part = (part - 1) & subset) {
+                if (!(part & lowest)) continue;
+                float cost = costs[part] + costs[subset ^ part];
+                if (cost < best) {
+                    best = cost;
+                    best_partition = (uint32_t)part;
+                }
+            }
+            costs[subset] = SAH_NODE_COST * bounds.surface_area() + best;
+            partitions[subset] = best_partition;
+        }
+
+        if (costs[subset_count - 1] >= nodes[root].cost * 0.999f) return; // Not worth it
+
+        size_t next_internal = 1;
+        std::function<uint32_t(size_t)> emit = [&](size_t subset) {
+            if ((subset & (subset - 1)) == 0) {
+                size_t i = 0;
+                while (!(subset & ((size_t)1 << i))) i++;
+                return leaves[i];
+            }
+
+            uint32_t index = subset == subset_count - 1 ? root : internals[next_internal++];
+            uint32_t children[2] = {
+                emit(partitions[subset]),
+                emit(subset ^ partitions[subset]),
+            };
+            for (size_t k = 0; k<2; k++) {
+                nodes[index].children[k] = children[k];
+                nodes[children[k]].parent = index;
+            }
+            update_internal_node(nodes, index);
+            return index;
+        };
+        emit(subset_count - 1);
+    }
+}
+
+void RawBVHTree::build_raw(const std::vector<AABB>& bounds, const std::vector<void*>& data, bool refine) {
+    assert(bounds.size() == data.size());
+    root = nullptr;
+
+    const size_t count = bounds.size();
+    if (count == 0) return;
+    if (count == 1) {
+        root = std::make_unique<BVHNode>(bounds[0], data[0]);
+        return;
+    }
+
+    auto& pool = ThreadPool::the();
+
+    // Morton codes of the leaf centres, normalised to the bounds of all the centres
+    AABB centre_bounds = AABB(bounds[0].centre(), bounds[0].centre());
+    for (auto& leaf_bounds : bounds) {
+        centre_bounds = centre_bounds.make_union(AABB(leaf_bounds.centre(), leaf_bounds.centre()));
+    }
+    glm::vec3 scale = 1.0f / glm::max(centre_bounds.upper - centre_bounds.lower, glm::vec3(1e-12f));
+
+    std::vector<uint32_t> codes(count);
+    std::vector<uint32_t> order(count);
+    pool.parallel_for(count, 4096, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i<end; i++) {
+            codes[i] = morton_code((bounds[i].centre() - centre_bounds.lower) * scale);
+            order[i] = (uint32_t)i;
+        }
+    });
+    radix_sort(codes, order);
+
+    // Emit the hierarchy, every internal node is independent of the others
+    const uint32_t leaf_offset = (uint32_t)(count - 1);
+    std::vector<LinearNode> nodes(2 * count - 1);
+
+    pool.parallel_for(count, 4096, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i<end; i++) {
+            auto& leaf = nodes[leaf_offset + i];
+            leaf.bounds = bounds[order[i]];
+            leaf.cost = SAH_LEAF_COST * leaf.bounds.surface_area();
+        }
+    });
+    pool.parallel_for(count - 1, 4096, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i<end; i++) {
+            build_internal_node(nodes, codes, i);
+        }
+    });
+
+    // Fit bounds bottom up. The second thread to arrive at a node handles it, so both children are always complete
+    std::vector<std::atomic<uint32_t>> visits(count - 1);
+    pool.parallel_for(count, 4096, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i<end; i++) {
+            uint32_t index = nodes[leaf_offset + i].parent;
+            while (index != INVALID_INDEX) {
+                if (visits[index].fetch_add(1, std::memory_order_acq_rel) == 0) break;
+
+                update_internal_node(nodes, index);
+                if (refine && nodes[index].leaf_count >= MAX_TREELET_LEAVES) {
+                    optimise_treelet(nodes, index, leaf_offset);
+                }
+                index = nodes[index].parent;
+            }
+        }
+    });
+
+    // Convert into the pointer based representation
+    std::vector<std::unique_ptr<BVHNode>> owned(nodes.size());
+    std::vector<BVHNode*> raw(nodes.size());
+    pool.parallel_for(nodes.size(), 4096, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i<end; i++) {
+            void* node_data = i >= leaf_offset ? data[order[i - leaf_offset]] : nullptr;
+            owned[i] = std::make_unique<BVHNode>(nodes[i].bounds, node_data);
+            raw[i] = owned[i].get();
+        }
+    });
+    pool.parallel_for(count - 1, 4096, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i<end; i++) {
+            raw[i]->children[0] = std::move(owned[nodes[i].children[0]]);
+            raw[i]->children[1] = std::move(owned[nodes[i].children[1]]);
+        }
+    });
+
+    root = std::move(owned[0]);
+}
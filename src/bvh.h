@@ -1,11 +1,80 @@
 #pragma once
 
 #include <memory>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <functional>
 
 #include "aabb.h"
 
+// Shape of a built tree, for comparing builders and spotting degenerate meshes
+struct BVHStats {
+    size_t node_count = 0; // Including leaves
+    size_t leaf_count = 0;
+    size_t primitive_count = 0;
+    size_t max_depth = 0;
+
+    // Expected cost of a query, with surface areas relative to the root
+    float sah_cost = 0.0f;
+    // Mean over internal nodes of the area of their children's overlap relative to their own
+    float sibling_overlap = 0.0f;
+
+    std::vector<size_t> depth_histogram;     // Leaves at each depth
+    std::vector<size_t> leaf_size_histogram; // Leaves holding each number of primitives
+
+    void add_node(const AABB& bounds, const AABB& child_a, const AABB& child_b, float root_area);
+    void add_leaf(const AABB& bounds, size_t depth, size_t primitives, float root_area);
+    void finish();
+};
+
+// Traversal work done by queries on any tree
+struct BVHQueryStats {
+    uint64_t queries = 0;
+    uint64_t nodes_visited = 0;
+    uint64_t leaves_tested = 0;
+};
+
+// Counters shared by every tree, cheap enough to always be on. Each query adds to them once.
+class BVHQueryCounters {
+    public:
+        static BVHQueryCounters& the() {
+            static BVHQueryCounters instance;
+            return instance;
+        }
+
+        BVHQueryCounters(BVHQueryCounters const&) = delete;
+        void operator=(BVHQueryCounters const&) = delete;
+
+        void record(size_t nodes_visited, size_t leaves_tested) {
+            queries.fetch_add(1, std::memory_order_relaxed);
+            visited.fetch_add(nodes_visited, std::memory_order_relaxed);
+            tested.fetch_add(leaves_tested, std::memory_order_relaxed);
+        }
+
+        // Everything recorded since the last call
+        BVHQueryStats collect() {
+            BVHQueryStats result;
+            result.queries = queries.exchange(0, std::memory_order_relaxed);
+            result.nodes_visited = visited.exchange(0, std::memory_order_relaxed);
+            result.leaves_tested = tested.exchange(0, std::memory_order_relaxed);
+            return result;
+        }
+
+    private:
+        BVHQueryCounters() {}
+
+        std::atomic<uint64_t> queries = { 0 };
+        std::atomic<uint64_t> visited = { 0 };
+        std::atomic<uint64_t> tested = { 0 };
+};
+
 class RawBVHTree {
     public:
+        // Relative costs of a traversal step and a primitive test, used by the builder and by the stats
+        static constexpr float SAH_NODE_COST = 1.2f;
+        static constexpr float SAH_LEAF_COST = 1.0f;
+
         AABB get_bounds() const {
             if (!root) {
                 return NAN_BOUNDS;
@@ -15,11 +84,23 @@ class RawBVHTree {
 
         void debug_draw() const;
 
+        // Bytes held by the nodes, not counting allocator overhead
+        size_t memory_usage() const;
+        BVHStats compute_stats() const;
+
     protected:
         void add_raw_node(const AABB& bounds, void* data);
+        // Replaces the tree with one built in bulk from the Morton codes of the leaf centres (LBVH),
+        // optionally followed by a pass that rearranges small treelets to minimise their SAH cost
+        void build_raw(const std::vector<AABB>& bounds, const std::vector<void*>& data, bool refine);
         std::vector<void*> intersect_raw(const AABB& bounds) const;
+        // Walks the leaves hit by the ray front to back. hit_test(data, max_distance) returns the distance to its hit,
+        // or anything >= max_distance for a miss. max_distance is shrunk to the closest hit, which is returned
+        void* ray_cast_raw(const glm::vec3& origin, const glm::vec3& direction, float& max_distance, const std::function<float(void*, float)>& hit_test) const;
 
     private:
+        template<class Q> friend class CompactBVHTree;
+
         struct BVHNode {
             BVHNode(AABB bounds, void* data) : bounds(bounds), data(data) {}
             BVHNode(AABB bounds) : BVHNode(bounds, nullptr) {}
@@ -43,8 +124,32 @@ class BVHTree: public RawBVHTree {
             add_raw_node(bounds, const_cast<void*>(reinterpret_cast<const void*>(data)));
         }
 
+        void build(const std::vector<AABB>& bounds, const std::vector<T*>& data, bool refine = false) {
+            std::vector<void*> raw_data;
+            raw_data.reserve(data.size());
+            for (auto ptr : data) {
+                raw_data.push_back(const_cast<void*>(reinterpret_cast<const void*>(ptr)));
+            }
+            build_raw(bounds, raw_data, refine);
+        }
+
         std::vector<T*> intersect(const AABB& bounds) const {
-            return intersect_raw(bounds);
+            auto raw = intersect_raw(bounds);
+
+            std::vector<T*> result;
+            result.reserve(raw.size());
+            for (auto ptr : raw) {
+                result.push_back(reinterpret_cast<T*>(ptr));
+            }
+            return result;
+        }
+
+        template<class F>
+        T* ray_cast(const glm::vec3& origin, const glm::vec3& direction, float& max_distance, F hit_test) const {
+            void* result = ray_cast_raw(origin, direction, max_distance, [&](void* data, float limit) {
+                return hit_test(reinterpret_cast<T*>(data), limit);
+            });
+            return reinterpret_cast<T*>(result);
         }
 };
 
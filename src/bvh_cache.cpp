@@ -0,0 +1,130 @@
+#include "bvh_cache.h"
+
+#include <fstream>
+#include <cstring>
+#include <filesystem>
+namespace fs = std::filesystem;
+
+#include "mapped_file.h"
+
+// Bump whenever the layout of the file or of CompactBVHTree slots changes
+static const uint32_t BVH_CACHE_VERSION = 1;
+static const char BVH_CACHE_MAGIC[4] = { 'B', 'V', 'H', 'C' };
+
+struct BVHCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t hash;
+    uint32_t bits;
+    uint32_t face_count;
+    uint64_t slot_count;
+    float bounds[6];
+    uint32_t root_is_leaf;
+
+    // Mass properties aren't part of the tree, but they cost about as much to compute
+    float inertia[9];
+    float centre_of_mass[3];
+    float volume;
+
+    uint32_t padding[3];
+};
+// Slots directly follow the header, so it has to keep them aligned
+static_assert(sizeof(BVHCacheHeader) == 128, "BVH cache header should be 128 bytes");
+
+uint64_t hash_file(const std::string& filename) {
+    auto file = MappedFile::open(filename);
+    if (!file) return 0;
+
+    uint64_t hash = 0xcbf29ce484222325ull;
+    const uint8_t* data = file->data();
+    for (size_t i = 0; i<file->size(); i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+template<class Q>
+bool load_bvh_cache(const std::string& filename, uint64_t hash, size_t face_count, CompactBVHTree<Q>& tree, ShapeProperties& properties) {
+    typedef typename CompactBVHTree<Q>::Slot Slot;
+
+    auto file = MappedFile::open(filename);
+    if (!file || file->size() < sizeof(BVHCacheHeader)) return false;
+
+    BVHCacheHeader header;
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic)) != 0
+            || header.version != BVH_CACHE_VERSION
+            || header.hash != hash
+            || header.bits != sizeof(Q) * 8
+            || header.face_count != face_count
+            || file->size() != sizeof(BVHCacheHeader) + header.slot_count * sizeof(Slot)) {
+        return false;
+    }
+
+    AABB bounds(glm::vec3(header.bounds[0], header.bounds[1], header.bounds[2]), glm::vec3(header.bounds[3], header.bounds[4], header.bounds[5]));
+    const Slot* slots = reinterpret_cast<const Slot*>(file->data() + sizeof(BVHCacheHeader));
+    tree.assign(bounds, header.root_is_leaf != 0, slots, header.slot_count, file);
+
+    // A damaged file could still point outside of the slots or faces
+    if (!tree.validate(face_count)) {
+        tree.clear();
+        return false;
+    }
+
+    for (glm::length_t i = 0; i<9; i++) {
+        properties.inertia[i / 3][i % 3] = header.inertia[i];
+    }
+    properties.centre_of_mass = glm::vec3(header.centre_of_mass[0], header.centre_of_mass[1], header.centre_of_mass[2]);
+    properties.volume = header.volume;
+    return true;
+}
+
+template<class Q>
+bool save_bvh_cache(const std::string& filename, uint64_t hash, size_t face_count, const CompactBVHTree<Q>& tree, const ShapeProperties& properties) {
+    typedef typename CompactBVHTree<Q>::Slot Slot;
+
+    BVHCacheHeader header = {};
+    std::memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic));
+    header.version = BVH_CACHE_VERSION;
+    header.hash = hash;
+    header.bits = sizeof(Q) * 8;
+    header.face_count = (uint32_t)face_count;
+    header.slot_count = tree.get_slot_count();
+    AABB bounds = tree.get_bounds();
+    for (glm::length_t axis = 0; axis<3; axis++) {
+        header.bounds[axis] = bounds.lower[axis];
+        header.bounds[axis + 3] = bounds.upper[axis];
+    }
+    header.root_is_leaf = tree.is_root_leaf() ? 1 : 0;
+    for (glm::length_t i = 0; i<9; i++) {
+        header.inertia[i] = properties.inertia[i / 3][i % 3];
+    }
+    for (glm::length_t axis = 0; axis<3; axis++) {
+        header.centre_of_mass[axis] = properties.centre_of_mass[axis];
+    }
+    header.volume = properties.volume;
+
+    // Written to a temporary file first so that an interrupted write never leaves a truncated cache behind
+    std::string temporary = filename + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        if (!file) return false;
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(tree.get_slots()), tree.get_slot_count() * sizeof(Slot));
+        if (!file) return false;
+    }
+
+    std::error_code error;
+    fs::rename(temporary, filename, error);
+    if (error) {
+        fs::remove(temporary, error);
+        return false;
+    }
+    return true;
+}
+
+template bool load_bvh_cache(const std::string&, uint64_t, size_t, CompactBVHTree<uint8_t>&, ShapeProperties&);
+template bool load_bvh_cache(const std::string&, uint64_t, size_t, CompactBVHTree<uint16_t>&, ShapeProperties&);
+template bool save_bvh_cache(const std::string&, uint64_t, size_t, const CompactBVHTree<uint8_t>&, const ShapeProperties&);
+template bool save_bvh_cache(const std::string&, uint64_t, size_t, const CompactBVHTree<uint16_t>&, const ShapeProperties&);
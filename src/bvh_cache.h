@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+#include "compact_bvh.h"
+#include "collider.h"
+
+// 64-bit FNV-1a hash of a file's contents, 0 if it can't be read
+uint64_t hash_file(const std::string& filename);
+
+// Maps a tree written by save_bvh_cache without copying it, along with the mass properties of the shape.
+// Fails if the file is missing, damaged, in another format or was written for other mesh contents,
+// in which case both should be recomputed.
+template<class Q>
+bool load_bvh_cache(const std::string& filename, uint64_t hash, size_t face_count, CompactBVHTree<Q>& tree, ShapeProperties& properties);
+
+template<class Q>
+bool save_bvh_cache(const std::string& filename, uint64_t hash, size_t face_count, const CompactBVHTree<Q>& tree, const ShapeProperties& properties);
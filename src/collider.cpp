@@ -32,20 +32,175 @@ ShapeProperties compute_shape_properties(const Shape& shape) {
 
 ShapeCollider::~ShapeCollider() {}
 
-void BVHShapeCollider::rebuild_bvh() {
-    tree = {};
-    
+static RayHit make_face_hit(const Shape& shape, const Face& face, float distance, glm::vec3 barycentric) {
+    auto& vertices = shape.get_vertices();
+    auto normal = glm::normalize(glm::cross(
+        vertices[face[1].vertex] - vertices[face[0].vertex],
+        vertices[face[2].vertex] - vertices[face[0].vertex]
+    ));
+    return { distance, normal, &face, barycentric };
+}
+
+std::optional<RayHit> ShapeCollider::ray_cast(glm::vec3 origin, glm::vec3 direction, float max_distance) const {
+    auto& vertices = get_shape().get_vertices();
+
+    const Face* closest = nullptr;
+    glm::vec3 closest_barycentric;
     for (auto& face : get_shape().get_faces()) {
-        AABB bounds({
-            get_shape().get_vertices()[face[0].vertex],
-            get_shape().get_vertices()[face[1].vertex],
-            get_shape().get_vertices()[face[2].vertex],
+        float distance;
+        glm::vec3 barycentric;
+        if (!intersect_ray_triangle(origin, direction, vertices[face[0].vertex], vertices[face[1].vertex], vertices[face[2].vertex], distance, barycentric)) continue;
+
+        if (distance < max_distance) {
+            max_distance = distance;
+            closest = &face;
+            closest_barycentric = barycentric;
+        }
+    }
+
+    if (!closest) return {};
+    return make_face_hit(get_shape(), *closest, max_distance, closest_barycentric);
+}
+
+void BVHShapeCollider::rebuild_bvh(bool refine) {
+    tree = {};
+
+    auto& faces = get_shape().get_faces();
+    auto& vertices = get_shape().get_vertices();
+
+    auto face_bounds = [&](const Face& face) {
+        return AABB({
+            vertices[face[0].vertex],
+            vertices[face[1].vertex],
+            vertices[face[2].vertex],
         });
+    };
+
+    if (faces.size() >= LINEAR_BUILD_THRESHOLD) {
+        std::vector<AABB> bounds;
+        std::vector<const Face*> data;
+        bounds.reserve(faces.size());
+        data.reserve(faces.size());
+        for (auto& face : faces) {
+            bounds.push_back(face_bounds(face));
+            data.push_back(&face);
+        }
+
+        tree.build(bounds, data, refine);
+    } else {
+        for (auto& face : faces) {
+            tree.add_node(face_bounds(face), &face);
+        }
+    }
+
+    tree_8.clear();
+    tree_16.clear();
+    if (storage != BVHStorage::POINTERS) {
+        auto triangle_index = [&](void* data) {
+            return (uint32_t)(reinterpret_cast<const Face*>(data) - faces.data());
+        };
+        if (storage == BVHStorage::QUANTISED_8) {
+            tree_8.build(tree, triangle_index);
+        } else {
+            tree_16.build(tree, triangle_index);
+        }
+        tree = {};
+    }
+}
+
+std::vector<const Face*> BVHShapeCollider::intersect(const AABB& bounds) const {
+    if (storage == BVHStorage::POINTERS) {
+        return tree.intersect(bounds);
+    }
+
+    auto& faces = get_shape().get_faces();
+    auto triangles = storage == BVHStorage::QUANTISED_8 ? tree_8.intersect(bounds) : tree_16.intersect(bounds);
 
-        tree.add_node(bounds, &face);
+    std::vector<const Face*> result;
+    result.reserve(triangles.size());
+    for (auto triangle : triangles) {
+        result.push_back(&faces[triangle]);
     }
+    return result;
+}
+
+size_t BVHShapeCollider::bvh_memory_usage() const {
+    switch (storage) {
+        case BVHStorage::QUANTISED_8:  return tree_8.memory_usage();
+        case BVHStorage::QUANTISED_16: return tree_16.memory_usage();
+        default:                       return tree.memory_usage();
+    }
+}
+
+BVHStats BVHShapeCollider::bvh_stats() const {
+    switch (storage) {
+        case BVHStorage::QUANTISED_8:  return tree_8.compute_stats();
+        case BVHStorage::QUANTISED_16: return tree_16.compute_stats();
+        default:                       return tree.compute_stats();
+    }
+}
+
+void BVHShapeCollider::debug_draw_bvh() const {
+    switch (storage) {
+        case BVHStorage::QUANTISED_8:  tree_8.debug_draw();  break;
+        case BVHStorage::QUANTISED_16: tree_16.debug_draw(); break;
+        default:                       tree.debug_draw();    break;
+    }
+}
+
+std::optional<RayHit> BVHShapeCollider::ray_cast(glm::vec3 origin, glm::vec3 direction, float max_distance) const {
+    auto& faces = get_shape().get_faces();
+    auto& vertices = get_shape().get_vertices();
+
+    glm::vec3 closest_barycentric;
+    auto hit_test = [&](const Face& face, float limit) {
+        float distance;
+        glm::vec3 barycentric;
+        if (!intersect_ray_triangle(origin, direction, vertices[face[0].vertex], vertices[face[1].vertex], vertices[face[2].vertex], distance, barycentric)) {
+            return limit;
+        }
+        if (distance < limit) closest_barycentric = barycentric;
+        return distance;
+    };
+
+    const Face* closest = nullptr;
+    if (storage == BVHStorage::POINTERS) {
+        closest = tree.ray_cast(origin, direction, max_distance, [&](const Face* face, float limit) {
+            return hit_test(*face, limit);
+        });
+    } else {
+        auto triangle_test = [&](uint32_t triangle, float limit) {
+            return hit_test(faces[triangle], limit);
+        };
+        uint32_t triangle = storage == BVHStorage::QUANTISED_8
+            ? tree_8.ray_cast(origin, direction, max_distance, triangle_test)
+            : tree_16.ray_cast(origin, direction, max_distance, triangle_test);
+        if (triangle != CompactBVHTree<uint8_t>::INVALID_TRIANGLE) {
+            closest = &faces[triangle];
+        }
+    }
+
+    if (!closest) return {};
+    return make_face_hit(get_shape(), *closest, max_distance, closest_barycentric);
 }
 
 BVHShapeCollider::~BVHShapeCollider() {}
 
+std::optional<RayHit> SphereCollider::ray_cast(glm::vec3 origin, glm::vec3 direction, float max_distance) const {
+    float b = glm::dot(origin, direction);
+    float c = glm::dot(origin, origin) - radius * radius;
+    if (c > 0.0f && b > 0.0f) return {}; // Outside and pointing away
+
+    float discriminant = b * b - c;
+    if (discriminant < 0.0f) return {};
+
+    float distance = std::max(-b - std::sqrt(discriminant), 0.0f);
+    if (distance > max_distance) return {};
+
+    RayHit hit;
+    hit.distance = distance;
+    hit.normal = glm::normalize(origin + direction * distance);
+    return hit;
+}
+
 SphereCollider::~SphereCollider() {}
\ No newline at end of file
@@ -1,6 +1,17 @@
 #pragma once
 
+#include <optional>
+
 #include "shape.h"
+#include "compact_bvh.h"
+
+// All in the local space of the collider
+struct RayHit {
+    float distance;
+    glm::vec3 normal;
+    const Face* face = nullptr; // Only set for shape colliders
+    glm::vec3 barycentric = glm::vec3(0.0f);
+};
 
 class Collider {
     public:
@@ -11,6 +22,14 @@ class Collider {
         virtual glm::mat3 get_inertia() const = 0;
         virtual AABB get_bounds() const = 0;
 
+        // Closest hit along a normalised direction, no further than max_distance
+        virtual std::optional<RayHit> ray_cast(glm::vec3 origin, glm::vec3 direction, float max_distance) const = 0;
+        std::optional<RayHit> segment_cast(glm::vec3 start, glm::vec3 end) const {
+            float length = glm::length(end - start);
+            if (length == 0.0f) return {};
+            return ray_cast(start, (end - start) / length, length);
+        }
+
         virtual ~Collider() {};
 };
 
@@ -34,8 +53,10 @@ class ShapeCollider : public Collider {
         float get_volume() const override { return properties.volume; }
         glm::mat3 get_inertia() const override { return properties.inertia; }
         AABB get_bounds() const override { return shape->get_bounds(); }
+        std::optional<RayHit> ray_cast(glm::vec3 origin, glm::vec3 direction, float max_distance) const override;
 
         virtual bool is_bvh_shape_collider() const { return false; }
+        const ShapeProperties& get_properties() const { return properties; }
         Shape& get_shape() { return *shape; }
         const Shape& get_shape() const { return *shape; }
 
@@ -44,26 +65,55 @@ class ShapeCollider : public Collider {
         ShapeProperties properties;
 };
 
+enum class BVHStorage {
+    POINTERS,     // Heap allocated nodes
+    QUANTISED_8,  // 16 byte nodes, CompactBVHTree<uint8_t>
+    QUANTISED_16, // 32 byte nodes, CompactBVHTree<uint16_t>
+};
+
 class BVHShapeCollider final : public ShapeCollider {
     public:
-        explicit BVHShapeCollider(std::shared_ptr<Shape> shape) : ShapeCollider(shape) {
+        // Meshes with at least this many faces are built in bulk instead of one face at a time. The loader only
+        // gives meshes this large a BVH collider, smaller ones test all of their faces.
+        static constexpr size_t LINEAR_BUILD_THRESHOLD = 4096;
+
+        explicit BVHShapeCollider(std::shared_ptr<Shape> shape, BVHStorage storage = BVHStorage::POINTERS) : ShapeCollider(shape), storage(storage) {
             rebuild_bvh();
         }
 
-        explicit BVHShapeCollider(std::shared_ptr<Shape> shape, const ShapeProperties& properties) : ShapeCollider(shape, properties) {
+        explicit BVHShapeCollider(std::shared_ptr<Shape> shape, const ShapeProperties& properties, BVHStorage storage = BVHStorage::POINTERS)
+                : ShapeCollider(shape, properties), storage(storage) {
             rebuild_bvh();
         };
+        // Takes a tree that was already built for this shape, e.g. one loaded from a cache
+        BVHShapeCollider(std::shared_ptr<Shape> shape, const ShapeProperties& properties, CompactBVHTree<uint8_t>&& compact_tree)
+                : ShapeCollider(shape, properties), storage(BVHStorage::QUANTISED_8), tree_8(std::move(compact_tree)) {}
+        BVHShapeCollider(std::shared_ptr<Shape> shape, const ShapeProperties& properties, CompactBVHTree<uint16_t>&& compact_tree)
+                : ShapeCollider(shape, properties), storage(BVHStorage::QUANTISED_16), tree_16(std::move(compact_tree)) {}
         ~BVHShapeCollider();
 
-        void rebuild_bvh();
+        void rebuild_bvh(bool refine = false);
 
         bool is_bvh_shape_collider() const override { return true; }
+        std::optional<RayHit> ray_cast(glm::vec3 origin, glm::vec3 direction, float max_distance) const override;
 
-        const BVHTree<const Face>& get_bvh_tree() { return tree; }
+        // Faces whose bounds may overlap, quantised trees can also return some that don't
+        std::vector<const Face*> intersect(const AABB& bounds) const;
+
+        BVHStorage get_storage() const { return storage; }
+        const BVHTree<const Face>& get_bvh_tree() const { return tree; } // Empty unless storage is POINTERS
+        const CompactBVHTree<uint8_t>& get_compact_tree_8() const { return tree_8; }
+        const CompactBVHTree<uint16_t>& get_compact_tree_16() const { return tree_16; }
+        size_t bvh_memory_usage() const;
+        BVHStats bvh_stats() const;
+        void debug_draw_bvh() const;
 
-        
     private:
+        BVHStorage storage;
+
         BVHTree<const Face> tree;
+        CompactBVHTree<uint8_t> tree_8;
+        CompactBVHTree<uint16_t> tree_16;
 };
 
 class SphereCollider final : public Collider {
@@ -80,6 +130,7 @@ class SphereCollider final : public Collider {
             return glm::mat3(moment);
         }
         AABB get_bounds() const { return AABB(glm::vec3(-radius), glm::vec3(radius)); }
+        std::optional<RayHit> ray_cast(glm::vec3 origin, glm::vec3 direction, float max_distance) const override;
 
         float get_radius() const { return radius; }
     private:
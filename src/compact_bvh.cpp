@@ -0,0 +1,335 @@
+#include "compact_bvh.h"
+
+#include <limits>
+#include <cassert>
+#include <unordered_map>
+
+#undef min
+#undef max
+
+template<class Q>
+AABB CompactBVHTree<Q>::decode(const AABB& parent, const Q* quantised) {
+    const float scale = 1.0f / std::numeric_limits<Q>::max();
+
+    // Interpolating between the corners (rather than offsetting from the lower one) makes 0 and max exact
+    glm::vec3 lower, upper;
+    for (glm::length_t axis = 0; axis<3; axis++) {
+        float t_lower = quantised[axis] * scale;
+        float t_upper = quantised[axis + 3] * scale;
+        lower[axis] = parent.lower[axis] * (1.0f - t_lower) + parent.upper[axis] * t_lower;
+        upper[axis] = parent.lower[axis] * (1.0f - t_upper) + parent.upper[axis] * t_upper;
+    }
+    return AABB(lower, upper);
+}
+
+template<class Q>
+void CompactBVHTree<Q>::encode(const AABB& parent, const AABB& child, Q* quantised) {
+    const Q max_value = std::numeric_limits<Q>::max();
+
+    for (glm::length_t axis = 0; axis<3; axis++) {
+        float extent = parent.upper[axis] - parent.lower[axis];
+        float scale = extent > 0.0f ? max_value / extent : 0.0f;
+
+        float lower = std::floor((child.lower[axis] - parent.lower[axis]) * scale);
+        float upper = std::ceil((child.upper[axis] - parent.lower[axis]) * scale);
+
+        quantised[axis]     = (Q)std::min(std::max(lower, 0.0f), (float)max_value);
+        quantised[axis + 3] = (Q)std::min(std::max(upper, 0.0f), (float)max_value);
+
+        // Rounding can still leave the decoded box slightly inside the child, so step outwards until it isn't
+        while (quantised[axis] > 0 && decode(parent, quantised).lower[axis] > child.lower[axis]) {
+            quantised[axis]--;
+        }
+        while (quantised[axis + 3] < max_value && decode(parent, quantised).upper[axis] < child.upper[axis]) {
+            quantised[axis + 3]++;
+        }
+    }
+}
+
+template<class Q>
+void CompactBVHTree<Q>::clear() {
+    bounds = NAN_BOUNDS;
+    root_is_leaf = false;
+    slots = nullptr;
+    slot_count = 0;
+    owned_slots.clear();
+    owner.reset();
+}
+
+template<class Q>
+void CompactBVHTree<Q>::assign(const AABB& root_bounds, bool leaf_root, const Slot* data, size_t count, std::shared_ptr<const void> data_owner) {
+    clear();
+    if (count == 0) return;
+
+    bounds = root_bounds;
+    root_is_leaf = leaf_root;
+    slots = data;
+    slot_count = count;
+    owner = std::move(data_owner);
+}
+
+template<class Q>
+void CompactBVHTree<Q>::build(const RawBVHTree& source, const std::function<uint32_t(void*)>& triangle_index) {
+    typedef RawBVHTree::BVHNode Node;
+
+    clear();
+    const Node* root = source.root.get();
+    if (!root) return;
+
+    // Subtrees that fit in a single leaf slot are collapsed into one
+    std::unordered_map<const Node*, size_t> leaf_counts;
+    std::function<size_t(const Node*)> count_leaves = [&](const Node* node) -> size_t {
+        if (!node) return 0;
+        size_t count = node->is_leaf() ? 1 : count_leaves(node->children[0].get()) + count_leaves(node->children[1].get());
+        leaf_counts[node] = count;
+        return count;
+    };
+    count_leaves(root);
+
+    auto emit_leaf = [&](const Node* node, size_t slot) {
+        size_t count = 0;
+        std::function<void(const Node*)> collect = [&](const Node* child) {
+            if (!child) return;
+            if (child->is_leaf()) {
+                owned_slots[slot].triangles[count++] = triangle_index(child->data);
+            } else {
+                collect(child->children[0].get());
+                collect(child->children[1].get());
+            }
+        };
+        for (auto& triangle : owned_slots[slot].triangles) {
+            triangle = INVALID_TRIANGLE;
+        }
+        collect(node);
+    };
+
+    // Children are quantised against the decoded bounds of their parent, which is what traversal reconstructs
+    std::function<void(const Node*, size_t, const AABB&)> emit_node = [&](const Node* node, size_t slot, const AABB& node_bounds) {
+        const size_t first = owned_slots.size();
+        assert(first + 2 < LEAF_FLAGS);
+        owned_slots.resize(first + 2);
+
+        uint32_t children = (uint32_t)first;
+        AABB child_bounds[2] = { NAN_BOUNDS, NAN_BOUNDS };
+        for (size_t i = 0; i<2; i++) {
+            const Node* child = node->children[i].get();
+            Q* quantised = owned_slots[slot].node.child_bounds[i];
+            if (child) {
+                encode(node_bounds, child->bounds, quantised);
+                child_bounds[i] = decode(node_bounds, quantised);
+            } else { // Inverted box that nothing can intersect
+                for (size_t axis = 0; axis<3; axis++) {
+                    quantised[axis] = std::numeric_limits<Q>::max();
+                    quantised[axis + 3] = 0;
+                }
+            }
+
+            if (leaf_counts[child] <= LEAF_CAPACITY) {
+                children |= leaf_flag(i);
+            }
+        }
+        owned_slots[slot].node.children = children;
+
+        for (size_t i = 0; i<2; i++) {
+            if (children & leaf_flag(i)) {
+                emit_leaf(node->children[i].get(), first + i);
+            } else {
+                emit_node(node->children[i].get(), first + i, child_bounds[i]);
+            }
+        }
+    };
+
+    bounds = root->bounds;
+    owned_slots.resize(1);
+    if (leaf_counts[root] <= LEAF_CAPACITY) {
+        root_is_leaf = true;
+        emit_leaf(root, 0);
+    } else {
+        emit_node(root, 0, bounds);
+    }
+    owned_slots.shrink_to_fit();
+
+    slots = owned_slots.data();
+    slot_count = owned_slots.size();
+}
+
+template<class Q>
+bool CompactBVHTree<Q>::validate(size_t triangle_count) const {
+    if (empty()) return true;
+
+    std::vector<std::pair<uint32_t, bool>> stack = { { 0, root_is_leaf } };
+    while (!stack.empty()) {
+        auto [index, is_leaf] = stack.back();
+        stack.pop_back();
+
+        auto& slot = slots[index];
+        if (is_leaf) {
+            for (auto triangle : slot.triangles) {
+                if (triangle != INVALID_TRIANGLE && triangle >= triangle_count) return false;
+            }
+            continue;
+        }
+
+        // Children always come after their parent, which also rules out cycles
+        uint32_t first = slot.node.children & ~LEAF_FLAGS;
+        if (first <= index || (size_t)first + 1 >= slot_count) return false;
+        for (uint32_t i = 0; i<2; i++) {
+            stack.push_back({ first + i, (slot.node.children & leaf_flag(i)) != 0 });
+        }
+    }
+    return true;
+}
+
+template<class Q>
+std::vector<uint32_t> CompactBVHTree<Q>::intersect(const AABB& query) const {
+    std::vector<uint32_t> result = {};
+    if (empty() || !bounds.intersect(query)) return result;
+
+    struct Entry {
+        uint32_t slot;
+        bool is_leaf;
+        AABB bounds;
+    };
+    size_t nodes_visited = 0;
+    size_t leaves_tested = 0;
+    std::vector<Entry> stack = { { 0, root_is_leaf, bounds } };
+    while (!stack.empty()) {
+        auto entry = stack.back();
+        stack.pop_back();
+        nodes_visited++;
+
+        auto& slot = slots[entry.slot];
+        if (entry.is_leaf) {
+            leaves_tested++;
+            for (auto triangle : slot.triangles) {
+                if (triangle == INVALID_TRIANGLE) break;
+                result.push_back(triangle);
+            }
+            continue;
+        }
+
+        uint32_t first = slot.node.children & ~LEAF_FLAGS;
+        for (uint32_t i = 0; i<2; i++) {
+            AABB child_bounds = decode(entry.bounds, slot.node.child_bounds[i]);
+            if (!child_bounds.intersect(query)) continue;
+
+            stack.push_back({ first + i, (slot.node.children & leaf_flag(i)) != 0, child_bounds });
+        }
+    }
+    BVHQueryCounters::the().record(nodes_visited, leaves_tested);
+
+    return result;
+}
+
+template<class Q>
+uint32_t CompactBVHTree<Q>::ray_cast(const glm::vec3& origin, const glm::vec3& direction, float& max_distance, const std::function<float(uint32_t, float)>& hit_test) const {
+    if (empty()) return INVALID_TRIANGLE;
+
+    const glm::vec3 inv_direction = 1.0f / direction;
+
+    float entry_distance;
+    if (!bounds.intersect_ray(origin, inv_direction, max_distance, entry_distance)) return INVALID_TRIANGLE;
+
+    struct Entry {
+        uint32_t slot;
+        bool is_leaf;
+        float entry;
+        AABB bounds;
+    };
+
+    uint32_t closest = INVALID_TRIANGLE;
+    size_t nodes_visited = 0;
+    size_t leaves_tested = 0;
+    std::vector<Entry> stack = { { 0, root_is_leaf, entry_distance, bounds } };
+    while (!stack.empty()) {
+        auto entry = stack.back();
+        stack.pop_back();
+
+        if (entry.entry > max_distance) continue; // A closer hit was found after this node was queued
+        nodes_visited++;
+
+        auto& slot = slots[entry.slot];
+        if (entry.is_leaf) {
+            leaves_tested++;
+            for (auto triangle : slot.triangles) {
+                if (triangle == INVALID_TRIANGLE) break;
+
+                float distance = hit_test(triangle, max_distance);
+                if (distance < max_distance) {
+                    max_distance = distance;
+                    closest = triangle;
+                }
+            }
+            continue;
+        }
+
+        uint32_t first = slot.node.children & ~LEAF_FLAGS;
+        Entry children[2] = {
+            { first,     (slot.node.children & leaf_flag(0)) != 0, 0.0f, decode(entry.bounds, slot.node.child_bounds[0]) },
+            { first + 1, (slot.node.children & leaf_flag(1)) != 0, 0.0f, decode(entry.bounds, slot.node.child_bounds[1]) },
+        };
+        bool hits[2];
+        for (uint32_t i = 0; i<2; i++) {
+            hits[i] = children[i].bounds.intersect_ray(origin, inv_direction, max_distance, children[i].entry);
+        }
+
+        // Push the far child first so that the near one is visited first
+        size_t near = (hits[0] && hits[1] && children[1].entry < children[0].entry) ? 1 : 0;
+        size_t far = 1 - near;
+        if (hits[far])  stack.push_back(children[far]);
+        if (hits[near]) stack.push_back(children[near]);
+    }
+    BVHQueryCounters::the().record(nodes_visited, leaves_tested);
+
+    return closest;
+}
+
+template<class Q>
+BVHStats CompactBVHTree<Q>::compute_stats() const {
+    BVHStats stats;
+    if (empty()) return stats;
+
+    const float root_area = bounds.surface_area();
+    std::function<void(uint32_t, bool, const AABB&, size_t)> visitor = [&](uint32_t index, bool is_leaf, const AABB& node_bounds, size_t depth) {
+        auto& slot = slots[index];
+        if (is_leaf) {
+            size_t count = 0;
+            while (count < LEAF_CAPACITY && slot.triangles[count] != INVALID_TRIANGLE) count++;
+            stats.add_leaf(node_bounds, depth, count, root_area);
+            return;
+        }
+
+        AABB child_bounds[2] = { decode(node_bounds, slot.node.child_bounds[0]), decode(node_bounds, slot.node.child_bounds[1]) };
+        stats.add_node(node_bounds, child_bounds[0], child_bounds[1], root_area);
+
+        uint32_t first = slot.node.children & ~LEAF_FLAGS;
+        for (uint32_t i = 0; i<2; i++) {
+            visitor(first + i, (slot.node.children & leaf_flag(i)) != 0, child_bounds[i], depth + 1);
+        }
+    };
+    visitor(0, root_is_leaf, bounds, 0);
+
+    stats.finish();
+    return stats;
+}
+
+template<class Q>
+void CompactBVHTree<Q>::debug_draw() const {
+    if (empty()) return;
+
+    std::function<void(uint32_t, bool, const AABB&)> visitor = [&](uint32_t index, bool is_leaf, const AABB& node_bounds) {
+        node_bounds.render();
+        if (is_leaf) return;
+
+        auto& slot = slots[index];
+        uint32_t first = slot.node.children & ~LEAF_FLAGS;
+        for (uint32_t i = 0; i<2; i++) {
+            visitor(first + i, (slot.node.children & leaf_flag(i)) != 0, decode(node_bounds, slot.node.child_bounds[i]));
+        }
+    };
+
+    visitor(0, root_is_leaf, bounds);
+}
+
+template class CompactBVHTree<uint8_t>;
+template class CompactBVHTree<uint16_t>;
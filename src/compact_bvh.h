@@ -0,0 +1,73 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <memory>
+#include <functional>
+
+#include "bvh.h"
+
+// Read-only BVH with child bounds quantised relative to their parent. Q is uint8_t (16 byte nodes)
+// or uint16_t (32 byte nodes). Leaves hold up to a node's worth of 32-bit triangle indices.
+template<class Q>
+class CompactBVHTree {
+    public:
+        static const uint32_t INVALID_TRIANGLE = 0xFFFFFFFFu;
+
+        union Slot {
+            struct {
+                Q child_bounds[2][6]; // Lower then upper corner of each child
+                uint32_t children;    // Index of the first of two consecutive child slots, the top bits flag leaf children
+            } node;
+            uint32_t triangles[(sizeof(Q) == 1 ? 16 : 32) / sizeof(uint32_t)];
+        };
+        static constexpr size_t LEAF_CAPACITY = sizeof(Slot::triangles) / sizeof(uint32_t);
+
+        CompactBVHTree() {}
+        CompactBVHTree(CompactBVHTree&&) = default;
+        CompactBVHTree& operator=(CompactBVHTree&&) = default;
+
+        // Built from an existing tree, triangle_index maps the data of its leaves to triangle indices
+        void build(const RawBVHTree& source, const std::function<uint32_t(void*)>& triangle_index);
+        // Uses slots stored elsewhere (e.g. a mapped cache file) without copying them, owner keeps them alive
+        void assign(const AABB& root_bounds, bool leaf_root, const Slot* data, size_t count, std::shared_ptr<const void> owner);
+        void clear();
+        // Checks that every child and triangle index is in range, for slots that weren't built here
+        bool validate(size_t triangle_count) const;
+
+        AABB get_bounds() const { return empty() ? NAN_BOUNDS : bounds; }
+        bool is_root_leaf() const { return root_is_leaf; }
+        const Slot* get_slots() const { return slots; }
+        size_t get_slot_count() const { return slot_count; }
+
+        bool empty() const { return slot_count == 0; }
+        // Only counts slots the tree owns, mapped ones are attributed to the file
+        size_t memory_usage() const { return sizeof(*this) + owned_slots.size() * sizeof(Slot); }
+        // Computed on the decoded (slightly inflated) bounds that queries actually test against
+        BVHStats compute_stats() const;
+
+        std::vector<uint32_t> intersect(const AABB& query) const;
+        // Same contract as RawBVHTree::ray_cast_raw, returns INVALID_TRIANGLE if nothing was hit
+        uint32_t ray_cast(const glm::vec3& origin, const glm::vec3& direction, float& max_distance, const std::function<float(uint32_t, float)>& hit_test) const;
+
+        void debug_draw() const;
+
+    private:
+        static const uint32_t LEAF_FLAGS = 0xC0000000u;
+        static uint32_t leaf_flag(size_t child) { return 0x80000000u >> child; }
+
+        static AABB decode(const AABB& parent, const Q* quantised);
+        static void encode(const AABB& parent, const AABB& child, Q* quantised);
+
+        // Slot 0 is the root, its bounds aren't quantised
+        AABB bounds = NAN_BOUNDS;
+        bool root_is_leaf = false;
+
+        const Slot* slots = nullptr; // Points into either owned_slots or owner
+        size_t slot_count = 0;
+        std::vector<Slot> owned_slots;
+        std::shared_ptr<const void> owner;
+};
+
+static_assert(sizeof(CompactBVHTree<uint8_t>::Slot) == 16, "8-bit BVH nodes should be 16 bytes");
+static_assert(sizeof(CompactBVHTree<uint16_t>::Slot) == 32, "16-bit BVH nodes should be 32 bytes");
@@ -3,6 +3,7 @@
 #include "scene.h"
 
 #include <iostream>
+#include <algorithm>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -12,22 +13,66 @@
 #undef max
 #undef min
 
-void BallSocketJoint::apply(const Scene& scene, float step_size) {
-    glm::vec3 r0 = obj_a.local_to_global_vec(local_a);
-    glm::vec3 r1 = obj_b.local_to_global_vec(local_b);
-
-    std::array<vec12, 3> J = {
+// Keeps the points at offsets r0 and r1 from the two objects together
+static std::array<vec12, 3> point_jacobian(glm::vec3 r0, glm::vec3 r1) {
+    return {
         vec12(-1.0f,  0.0f,  0.0f,   0.0f, -r0.z,  r0.y,  1.0f, 0.0f, 0.0f,   0.0f,  r1.z, -r1.y),
         vec12( 0.0f, -1.0f,  0.0f,   r0.z,  0.0f, -r0.x,  0.0f, 1.0f, 0.0f,  -r1.z,  0.0f,  r1.x),
         vec12( 0.0f,  0.0f, -1.0f,  -r0.y,  r0.x,  0.0f,  0.0f, 0.0f, 1.0f,   r1.y, -r1.x,  0.0f),
     };
+}
 
-    glm::vec3 bias = (scene.baumgarte_bias / step_size) * (obj_b.position + r1 - obj_a.position - r0);
-    
-    MassMatrix M(obj_a, obj_b);
-    vec12 V = combined_velocity_vector(obj_a, obj_b);
-    V += apply_constraint(J, M, resolve_constraint(J, M, V, bias));
-    set_velocity(obj_a, obj_b, V);
+// What the bodies moved with during the last substep
+static vec12 substep_velocity(const SolverBody& a, const SolverBody& b) {
+    return combined_velocity_vector(a, b) + combined_split_velocity_vector(a, b);
+}
+
+// Joints keep their position error in the position bias, solve adds it back to the velocity bias.
+// Only JointTree uses it for the split velocities: without warm starting, iterating a split pass
+// from zero every step converges far too slowly along chains.
+void BallSocketJoint::prepare(const Scene& scene, float step_size) {
+    glm::vec3 r0 = obj_a.local_to_global_vec(local_a);
+    glm::vec3 r1 = obj_b.local_to_global_vec(local_b);
+
+    SoftCoefficients soft(softness, scene.baumgarte_bias, step_size);
+    rows.prepare(point_jacobian(r0, r1), MassMatrix(*body_a, *body_b), glm::vec3(0.0f), obj_b.position() + r1 - obj_a.position() - r0, soft);
+    rows.fold_static(combined_velocity_vector(*body_a, *body_b), static_blocks);
+}
+
+void BallSocketJoint::warm_start(float factor) {
+    impulse_sum *= factor;
+
+    vec12 V = combined_velocity_vector(*body_a, *body_b);
+    rows.apply(V, impulse_sum);
+    set_velocity(*body_a, *body_b, V);
+}
+
+void BallSocketJoint::advance(float substep) {
+    rows.advance(substep_velocity(*body_a, *body_b), substep);
+}
+
+float BallSocketJoint::solve() {
+    float residual = 0.0f;
+    with_static_blocks([&](auto skipped) {
+        constexpr unsigned STATIC = decltype(skipped)::value;
+
+        vec12 V = combined_velocity_vector(*body_a, *body_b);
+        auto lambda = rows.resolve<STATIC>(V, rows.bias + rows.position_bias, impulse_sum);
+        impulse_sum += lambda;
+        rows.apply<STATIC>(V, lambda);
+        set_velocity(*body_a, *body_b, V);
+
+        residual = rows.residual(lambda);
+    });
+    return residual;
+}
+
+void BallSocketJoint::get_direct_rows(vec12* J, float* bias, float* position_bias) const {
+    for (size_t i = 0; i<3; i++) {
+        J[i] = rows.J[i];
+        bias[i] = rows.bias[(glm::length_t)i];
+        position_bias[i] = rows.position_bias[(glm::length_t)i];
+    }
 }
 
 // void FixedJoint::apply(const Scene& scene, float step_size) {
@@ -44,7 +89,7 @@ void BallSocketJoint::apply(const Scene& scene, float step_size) {
 //             vec12( 0.0f,  0.0f, -1.0f,  -r0.y,  r0.x,  0.0f,  0.0f, 0.0f, 1.0f,   r1.y, -r1.x,  0.0f),
 //         };
 
-//         glm::vec3 bias = (scene.baumgarte_bias / step_size) * (obj_b.position + r1 - obj_a.position - r0);
+//         glm::vec3 bias = (scene.baumgarte_bias / step_size) * (obj_b.position() + r1 - obj_a.position() - r0);
         
 //         V += apply_constraint(J, M, resolve_constraint(J, M, V, bias));
 //     }
@@ -64,153 +109,399 @@ void BallSocketJoint::apply(const Scene& scene, float step_size) {
 //     set_velocity(obj_a, obj_b, V);
 // }
 
-void HingeJoint::apply(const Scene& scene, float step_size) {
-    MassMatrix M(obj_a, obj_b);
-    vec12 V = combined_velocity_vector(obj_a, obj_b);
-    
+void HingeJoint::prepare(const Scene& scene, float step_size) {
+    MassMatrix M(*body_a, *body_b);
+    vec12 V = combined_velocity_vector(*body_a, *body_b);
+    SoftCoefficients soft(softness, scene.baumgarte_bias, step_size);
+
     { // Position constraint
         glm::vec3 r0 = obj_a.local_to_global_vec(local_a);
         glm::vec3 r1 = obj_b.local_to_global_vec(local_b);
 
-        std::array<vec12, 3> J = {
-            vec12(-1.0f,  0.0f,  0.0f,   0.0f, -r0.z,  r0.y,  1.0f, 0.0f, 0.0f,   0.0f,  r1.z, -r1.y),
-            vec12( 0.0f, -1.0f,  0.0f,   r0.z,  0.0f, -r0.x,  0.0f, 1.0f, 0.0f,  -r1.z,  0.0f,  r1.x),
-            vec12( 0.0f,  0.0f, -1.0f,  -r0.y,  r0.x,  0.0f,  0.0f, 0.0f, 1.0f,   r1.y, -r1.x,  0.0f),
-        };
-
-        glm::vec3 bias = (scene.baumgarte_bias / step_size) * (obj_b.position + r1 - obj_a.position - r0);
-        
-        
-        V += apply_constraint(J, M, resolve_constraint(J, M, V, bias));
+        position_rows.prepare(point_jacobian(r0, r1), M, glm::vec3(0.0f), obj_b.position() + r1 - obj_a.position() - r0, soft);
+        position_rows.fold_static(V, static_blocks);
     }
     { // Angle constraint
         glm::vec3 v0 = obj_a.local_to_global_vec(local_vec_a);
         glm::vec3 v1 = obj_b.local_to_global_vec(local_vec_b);
 
+        // The impulse carried over is moved onto the new tangents through global space, like a contact's friction
         auto tangents = compute_tangents(v1);
+        glm::vec3 impulse = angle_tangents[0] * angle_impulse_sum.x + angle_tangents[1] * angle_impulse_sum.y;
+        angle_impulse_sum = glm::vec2(glm::dot(impulse, tangents[0]), glm::dot(impulse, tangents[1]));
+        angle_tangents = tangents;
+
         std::array<vec12, 2> J = {
             vec12(glm::vec3(0.0f), glm::cross(v0, tangents[0]), glm::vec3(0.0f), glm::cross(tangents[0], v0)),
             vec12(glm::vec3(0.0f), glm::cross(v0, tangents[1]), glm::vec3(0.0f), glm::cross(tangents[1], v0)),
         };
 
-        glm::vec2 bias = (scene.baumgarte_bias / step_size) * glm::vec2(glm::dot(v0, tangents[0]), glm::dot(v0, tangents[1]));
+        angle_rows.prepare(J, M, glm::vec2(0.0f), glm::vec2(glm::dot(v0, tangents[0]), glm::dot(v0, tangents[1])), soft);
+        angle_rows.fold_static(V, static_blocks);
+    }
+}
 
-        V += apply_constraint(J, M, resolve_constraint(J, M, V, bias));
+void HingeJoint::warm_start(float factor) {
+    position_impulse_sum *= factor;
+    angle_impulse_sum *= factor;
+
+    vec12 V = combined_velocity_vector(*body_a, *body_b);
+    position_rows.apply(V, position_impulse_sum);
+    angle_rows.apply(V, angle_impulse_sum);
+    set_velocity(*body_a, *body_b, V);
+}
+
+void HingeJoint::advance(float substep) {
+    vec12 V = substep_velocity(*body_a, *body_b);
+    position_rows.advance(V, substep);
+    angle_rows.advance(V, substep);
+}
+
+float HingeJoint::solve() {
+    float residual = 0.0f;
+    with_static_blocks([&](auto skipped) {
+        constexpr unsigned STATIC = decltype(skipped)::value;
+
+        vec12 V = combined_velocity_vector(*body_a, *body_b);
+
+        auto lambda = position_rows.resolve<STATIC>(V, position_rows.bias + position_rows.position_bias, position_impulse_sum);
+        position_impulse_sum += lambda;
+        position_rows.apply<STATIC>(V, lambda);
+
+        auto angle_lambda = angle_rows.resolve<STATIC>(V, angle_rows.bias + angle_rows.position_bias, angle_impulse_sum);
+        angle_impulse_sum += angle_lambda;
+        angle_rows.apply<STATIC>(V, angle_lambda);
+
+        set_velocity(*body_a, *body_b, V);
+
+        residual = std::max(position_rows.residual(lambda), angle_rows.residual(angle_lambda));
+    });
+    return residual;
+}
+
+void HingeJoint::get_direct_rows(vec12* J, float* bias, float* position_bias) const {
+    for (size_t i = 0; i<3; i++) {
+        J[i] = position_rows.J[i];
+        bias[i] = position_rows.bias[(glm::length_t)i];
+        position_bias[i] = position_rows.position_bias[(glm::length_t)i];
     }
+    for (size_t i = 0; i<2; i++) {
+        J[3 + i] = angle_rows.J[i];
+        bias[3 + i] = angle_rows.bias[(glm::length_t)i];
+        position_bias[3 + i] = angle_rows.position_bias[(glm::length_t)i];
+    }
+}
 
-    set_velocity(obj_a, obj_b, V);
+// Twice the area of the quadrilateral the points span, in whichever order makes the largest one
+static float quad_area(glm::vec3 a, glm::vec3 b, glm::vec3 c, glm::vec3 d) {
+    return std::max({
+        glm::length(glm::cross(a - b, c - d)),
+        glm::length(glm::cross(a - c, b - d)),
+        glm::length(glm::cross(a - d, b - c)),
+    });
 }
 
 void ContactConstraint::add_contact(glm::vec3 offset_a, glm::vec3 offset_b, glm::vec3 normal) {
-    assert(contact_count < 2);
-    auto& contact = contacts[contact_count++];
+    Contact contact;
 
     contact.offsets[0] = offset_a;
     contact.offsets[1] = offset_b;
+    contact.anchor = obj_a.global_to_local_vec(offset_a);
     contact.normal = normal;
 
     auto t = compute_tangents(normal);
     contact.tangents[0] = t[0];
     contact.tangents[1] = t[1];
 
-    auto global_a = obj_a.position + offset_a;
-    auto global_b = obj_b.position + offset_b;
+    auto global_a = obj_a.position() + offset_a;
+    auto global_b = obj_b.position() + offset_b;
 
     contact.penetration = glm::dot(global_b - global_a, normal);
 
-    auto vel_a = obj_a.linear_velocity + glm::cross(obj_a.angular_velocity, offset_a); 
-    auto vel_b = obj_b.linear_velocity + glm::cross(obj_b.angular_velocity, offset_b);
+    auto vel_a = obj_a.linear_velocity() + glm::cross(obj_a.angular_velocity(), offset_a); 
+    auto vel_b = obj_b.linear_velocity() + glm::cross(obj_b.angular_velocity(), offset_b);
     contact.closing_velocity = 0.0f;// glm::dot(normal, vel_b - vel_a);
+
+    if (contact_count < MAX_CONTACTS) {
+        contacts[contact_count++] = contact;
+        return;
+    }
+
+    // Full, one of the five points has to go. The deepest one stays, of the others the one
+    // without which the remaining four span the largest area.
+    static_assert(MAX_CONTACTS == 4);
+    std::array<const Contact*, 5> points = { &contacts[0], &contacts[1], &contacts[2], &contacts[3], &contact };
+    size_t deepest = 0;
+    for (size_t i = 1; i<points.size(); i++) {
+        if (points[i]->penetration < points[deepest]->penetration) deepest = i;
+    }
+
+    size_t dropped = 0;
+    float largest_area = -1.0f;
+    for (size_t i = 0; i<points.size(); i++) {
+        if (i == deepest) continue;
+
+        std::array<glm::vec3, 4> rest;
+        for (size_t j = 0, k = 0; j<points.size(); j++) {
+            if (j != i) rest[k++] = points[j]->offsets[0];
+        }
+        float area = quad_area(rest[0], rest[1], rest[2], rest[3]);
+        if (area > largest_area) {
+            largest_area = area;
+            dropped = i;
+        }
+    }
+    if (dropped < MAX_CONTACTS) contacts[dropped] = contact;
 }
 
-void ContactConstraint::apply(const Scene& scene, float step_size) {
-    MassMatrix M(obj_a, obj_b);
-    vec12 V = combined_velocity_vector(obj_a, obj_b);
+void ContactConstraint::warm_start(const ContactCache& previous, float factor) {
+    vec12 V = combined_velocity_vector(*body_a, *body_b);
 
-    // Constraint that ensures that the relative velocity along the normal is 0
-    auto compute_jacobian = [&](glm::vec3 normal, const Contact& contact) { 
-        return vec12(-normal, glm::cross(normal, contact.offsets[0]), normal, glm::cross(contact.offsets[1], normal));
-    };
+    bool used[ContactCache::MAX_CONTACTS] = {};
+    for (size_t i = 0; i<contact_count; i++) {
+        auto& contact = contacts[i];
 
-    float friction = std::sqrt(obj_a.friction * obj_b.friction);
-    float restitution = std::sqrt(obj_a.restitution * obj_b.restitution);
-    
-    // Normal component
-    if (contact_count == 1) {
-        auto J = compute_jacobian(contacts[0].normal, contacts[0]);
+        for (size_t j = 0; j<previous.contact_count; j++) {
+            if (used[j]) continue;
+            if (glm::length(contact.anchor - previous.anchors[j]) > WARM_START_DISTANCE) continue;
+            if (glm::dot(contact.normal, previous.normals[j]) < WARM_START_NORMAL_DOT) continue;
+            used[j] = true;
+
+            normal_impulse_sum[i] = factor * previous.normal_impulses[j];
+            contact.tangent_impulse_sum = factor * glm::vec2(
+                glm::dot(contact.tangents[0], previous.tangent_impulses[j]),
+                glm::dot(contact.tangents[1], previous.tangent_impulses[j])
+            );
+
+            contact.normal_row.apply(V, normal_impulse_sum[i]);
+            contact.tangent_rows.apply(V, contact.tangent_impulse_sum);
+            break;
+        }
+    }
 
-        float bias = (scene.baumgarte_bias / step_size) * contacts[0].penetration - contacts[0].closing_velocity * restitution;
+    set_velocity(*body_a, *body_b, V);
+}
+
+void ContactConstraint::warm_start() {
+    vec12 V = combined_velocity_vector(*body_a, *body_b);
+    for (size_t i = 0; i<contact_count; i++) {
+        contacts[i].normal_row.apply(V, normal_impulse_sum[i]);
+        contacts[i].tangent_rows.apply(V, contacts[i].tangent_impulse_sum);
+    }
+    set_velocity(*body_a, *body_b, V);
+}
 
-        auto lambda = resolve_constraint(J, M, V, bias);
+ContactCache ContactConstraint::save_cache() const {
+    ContactCache cache;
+    cache.a = &obj_a;
+    cache.b = &obj_b;
+    cache.contact_count = contact_count;
+    for (size_t i = 0; i<contact_count; i++) {
+        auto& contact = contacts[i];
+        cache.anchors[i] = contact.anchor;
+        cache.normals[i] = contact.normal;
+        cache.normal_impulses[i] = normal_impulse_sum[i];
+        cache.tangent_impulses[i] = contact.tangents[0] * contact.tangent_impulse_sum.x + contact.tangents[1] * contact.tangent_impulse_sum.y;
+    }
+    return cache;
+}
+
+void ContactConstraint::prepare(const Scene& scene, float step_size) {
+    split_impulse = scene.split_impulse;
+    split_impulse_sum = glm::vec4(0.0f);
+    MassMatrix M(*body_a, *body_b);
+    vec12 V = combined_velocity_vector(*body_a, *body_b);
+
+    friction = std::sqrt(obj_a.friction * obj_b.friction);
+    float restitution = std::sqrt(obj_a.restitution * obj_b.restitution);
+    float slop = scene.solver_substeps > 1 ? SUBSTEP_SLOP : 0.0f;
+    soft = SoftCoefficients(scene.contact_softness, scene.baumgarte_bias, step_size);
+    inv_step_size = 1.0f / step_size;
+
+    for (size_t i = 0; i<contact_count; i++) {
+        auto& contact = contacts[i];
 
-        float prev_impulse_sum = normal_impulse_sum.x;
-        normal_impulse_sum.x = glm::max(prev_impulse_sum + lambda, 0.0f);
+        // Restitution is a velocity target, it stays in the velocity bias either way
+        contact.normal_row.prepare(compute_jacobian(contact.normal, contact), M, -contact.closing_velocity * restitution);
+        contact.normal_row.fold_static(V, static_blocks);
+        contact.velocity_bias = contact.normal_row.bias;
+        contact.separation = contact.penetration + slop;
+        set_biases(contact);
 
-        V += apply_constraint(J, M, normal_impulse_sum.x - prev_impulse_sum);
-    } else if (contact_count == 2) {
         std::array<vec12, 2> J = {
-            compute_jacobian(contacts[0].normal, contacts[0]),
-            compute_jacobian(contacts[1].normal, contacts[1]),
+            compute_jacobian(contact.tangents[0], contact),
+            compute_jacobian(contact.tangents[1], contact),
         };
-        glm::vec2 bias = (scene.baumgarte_bias / step_size) * glm::vec2(contacts[0].penetration, contacts[1].penetration)
-             - glm::vec2(contacts[0].closing_velocity, contacts[1].closing_velocity) * restitution;
-
-        glm::vec2 prev_impulse_sum = normal_impulse_sum;
-        normal_impulse_sum += resolve_constraint(J, M, V, bias);
-
-        if (normal_impulse_sum.x < 0.0f && normal_impulse_sum.y < 0.0f) { // Both separating
-            normal_impulse_sum = glm::vec2(0.0f);
-
-            V += apply_constraint(J, M, -prev_impulse_sum);
-        } else if (normal_impulse_sum.x < 0.0f) { // Contact 0 separating
-            normal_impulse_sum.x = 0.0f;
-            V += apply_constraint(J[0], M, -prev_impulse_sum.x);
-
-            normal_impulse_sum.y = glm::max(normal_impulse_sum.y + resolve_constraint(J[1], M, V, bias.y), 0.0f);
-            V += apply_constraint(J[1], M, normal_impulse_sum.y - prev_impulse_sum.y);
-        } else if (normal_impulse_sum.y < 0.0f) { // Contact 1 separating
-            normal_impulse_sum.y = 0.0f;
-            V += apply_constraint(J[1], M, -prev_impulse_sum.y);
-
-            normal_impulse_sum.x = glm::max(normal_impulse_sum.x + resolve_constraint(J[0], M, V, bias.x), 0.0f);
-            V += apply_constraint(J[0], M, normal_impulse_sum.x - prev_impulse_sum.x);
-        } else { // Both non-separating
-            V += apply_constraint(J, M, normal_impulse_sum - prev_impulse_sum);
+        contact.tangent_rows.prepare(J, M, glm::vec2(0.0f));
+        contact.tangent_rows.fold_static(V, static_blocks);
+    }
+
+    block_solve = contact_count > 1 && prepare_normal_block();
+}
+
+// Gauss-Jordan elimination of J * M * J^T of the normal rows, which is symmetric positive semi-definite so it needs
+// no pivoting. Its determinant is at most the product of its diagonal, much less than that means that the rows
+// (nearly) depend on each other and the block solve would be ill-conditioned.
+bool ContactConstraint::prepare_normal_block() {
+    const size_t n = contact_count;
+    float K[MAX_CONTACTS][MAX_CONTACTS];
+    float diagonal_product = 1.0f;
+    for (size_t i = 0; i<n; i++) {
+        for (size_t j = 0; j<n; j++) {
+            K[i][j] = contacts[i].normal_row.J.dot(contacts[j].normal_row.MJ);
+            normal_block_mass[i][j] = i == j ? 1.0f : 0.0f;
         }
+        diagonal_product *= K[i][i];
+    }
+
+    float determinant = 1.0f;
+    for (size_t c = 0; c<n; c++) {
+        float pivot = K[c][c];
+        determinant *= pivot;
+        if (!(determinant > BLOCK_CONDITION * diagonal_product)) return false;
 
-        //std::cout << obj_a.get_name() << "," << obj_b.get_name() << " -> " << glm::to_string(prev_impulse_sum) << ", " << glm::to_string(normal_impulse_sum) << std::endl;
+        for (size_t j = 0; j<n; j++) {
+            K[c][j] /= pivot;
+            normal_block_mass[c][j] /= pivot;
+        }
+        for (size_t i = 0; i<n; i++) {
+            if (i == c) continue;
+            float factor = K[i][c];
+            for (size_t j = 0; j<n; j++) {
+                K[i][j] -= factor * K[c][j];
+                normal_block_mass[i][j] -= factor * normal_block_mass[c][j];
+            }
+        }
+    }
+    return true;
+}
+
+// Points that are still apart (speculative contacts, see Scene::speculative_contacts) may close the whole gap within
+// the step but no more, so the solver stops the bodies right at the surface. Only overlapping points are pushed
+// apart, softly or with the Baumgarte bias. Without split impulses that is part of the velocity bias as well.
+void ContactConstraint::set_biases(Contact& contact) {
+    auto& row = contact.normal_row;
+    if (contact.separation > 0.0f) {
+        row.bias = contact.velocity_bias + contact.separation * inv_step_size;
+        row.position_bias = 0.0f;
+        row.soft = SoftCoefficients();
+    } else if (split_impulse) {
+        row.bias = contact.velocity_bias;
+        row.position_bias = soft.bias_rate * contact.separation;
+        row.soft = soft;
     } else {
-        assert(false);
+        row.bias = contact.velocity_bias + soft.bias_rate * contact.separation;
+        row.position_bias = 0.0f;
+        row.soft = soft;
+    }
+}
+
+// J * V is how fast the points move apart along the normal
+void ContactConstraint::advance(float substep) {
+    vec12 V = substep_velocity(*body_a, *body_b);
+    for (size_t i = 0; i<contact_count; i++) {
+        auto& contact = contacts[i];
+        contact.separation += substep * contact.normal_row.J.dot(V);
+        set_biases(contact);
     }
+    split_impulse_sum = glm::vec4(0.0f);
+}
+
+float ContactConstraint::solve() {
+    // Against the ground and other static objects only one body is left
+    float residual = 0.0f;
+    with_static_blocks([&](auto skipped) {
+        residual = solve<decltype(skipped)::value>();
+    });
+    return residual;
+}
+
+template<unsigned STATIC>
+float ContactConstraint::solve() {
+    vec12 V = combined_velocity_vector(*body_a, *body_b);
+    float residual = solve_normals<STATIC>(V);
 
     // Friction component
     for (size_t i = 0; i<contact_count; i++) {
     //for (size_t i = 0; i<1; i++) {
         auto& contact = contacts[i];
-        std::array<vec12, 2> J = {
-            compute_jacobian(contact.tangents[0], contact),
-            compute_jacobian(contact.tangents[1], contact),
-        };
-
-        auto lambda = resolve_constraint(J, M, V, glm::vec2(0.0f));
+        auto lambda = contact.tangent_rows.resolve<STATIC>(V);
 
         float maximum = normal_impulse_sum[i] * friction;
         glm::vec2 impulse_sum = glm::max(glm::min(contact.tangent_impulse_sum + lambda, maximum), -maximum);
         lambda = impulse_sum - contact.tangent_impulse_sum;
         contact.tangent_impulse_sum = impulse_sum;
 
-        V += apply_constraint(J, M, lambda);
+        contact.tangent_rows.apply<STATIC>(V, lambda);
+        residual = std::max(residual, contact.tangent_rows.residual(lambda));
+    }
+
+    set_velocity(*body_a, *body_b, V);
+    if (!split_impulse) return residual;
+
+    // Pushes the bodies apart without leaving them with the velocity, the points are solved one after the other
+    vec12 P = combined_split_velocity_vector(*body_a, *body_b);
+    for (size_t i = 0; i<contact_count; i++) {
+        auto& row = contacts[i].normal_row;
+        float previous = split_impulse_sum[i];
+        split_impulse_sum[i] = glm::max(previous + row.resolve_split<STATIC>(P), 0.0f);
+        row.apply<STATIC>(P, split_impulse_sum[i] - previous);
+        residual = std::max(residual, row.residual(split_impulse_sum[i] - previous));
+    }
+    set_split_velocity(*body_a, *body_b, P);
+    return residual;
+}
+
+// All points at once, as long as none of them end up pulling. Otherwise (or if the points depend on each other too
+// much for a block solve) they are solved one after the other, which converges to the same over the iterations.
+template<unsigned STATIC>
+float ContactConstraint::solve_normals(vec12& V) {
+    if (!block_solve) return solve_normals_sequential<STATIC>(V);
+
+    // Each row's coefficients soften its part of the block solve
+    float error[MAX_CONTACTS];
+    for (size_t i = 0; i<contact_count; i++) error[i] = contacts[i].normal_row.error<STATIC>(V);
+
+    glm::vec4 impulse_sum = normal_impulse_sum;
+    for (size_t i = 0; i<contact_count; i++) {
+        auto& row = contacts[i].normal_row;
+        float lambda = 0.0f;
+        for (size_t j = 0; j<contact_count; j++) lambda += normal_block_mass[i][j] * error[j];
+
+        impulse_sum[i] += row.soft.mass_scale * lambda - row.soft.impulse_scale * normal_impulse_sum[i];
+        if (impulse_sum[i] < 0.0f) return solve_normals_sequential<STATIC>(V);
     }
 
-    set_velocity(obj_a, obj_b, V);
+    float residual = 0.0f;
+    for (size_t i = 0; i<contact_count; i++) {
+        auto& row = contacts[i].normal_row;
+        row.apply<STATIC>(V, impulse_sum[i] - normal_impulse_sum[i]);
+        residual = std::max(residual, row.residual(impulse_sum[i] - normal_impulse_sum[i]));
+    }
+    normal_impulse_sum = impulse_sum;
+    return residual;
+}
+
+template<unsigned STATIC>
+float ContactConstraint::solve_normals_sequential(vec12& V) {
+    float residual = 0.0f;
+    for (size_t i = 0; i<contact_count; i++) {
+        auto& row = contacts[i].normal_row;
+        float previous = normal_impulse_sum[i];
+        normal_impulse_sum[i] = glm::max(previous + row.resolve<STATIC>(V, previous), 0.0f);
+
+        row.apply<STATIC>(V, normal_impulse_sum[i] - previous);
+        residual = std::max(residual, row.residual(normal_impulse_sum[i] - previous));
+    }
+    return residual;
 }
 
 void ContactConstraint::draw_debug() const {
     for (size_t i = 0; i<contact_count; i++) {
         auto& contact = contacts[i];
         
-        auto point_a = contact.offsets[0] + obj_a.position;
-        auto point_b = contact.offsets[1] + obj_b.position;
+        auto point_a = contact.offsets[0] + obj_a.position();
+        auto point_b = contact.offsets[1] + obj_b.position();
 
         glBegin(GL_POINTS);
         glVertex(point_a);
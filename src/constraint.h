@@ -1,15 +1,61 @@
 #pragma once
 
+#include <type_traits>
+#include <cmath>
+
 #include "object.h"
 
-inline vec12 constexpr combined_velocity_vector(const Object& a, const Object& b) { 
+// What the solver needs of a body, copied into one compact array per step (Scene::solver_bodies)
+// in the order of Scene::body_storage
+struct SolverBody {
+    glm::vec3 linear_velocity;
+    glm::vec3 angular_velocity;
+    glm::vec3 split_linear_velocity; // Only move the body for one step, see Scene::split_impulse
+    glm::vec3 split_angular_velocity;
+    glm::vec3 delta_position; // How far the substeps have moved the body, see Scene::solver_substeps
+    glm::vec3 delta_rotation; // Axis times angle
+    glm::mat3 inverse_inertia; // Global space
+    float inv_mass;
+    bool is_static; // Never written, may be shared between solver threads
+
+    void load(BodyStorage& bodies, size_t i) {
+        linear_velocity = bodies.linear_velocities[i];
+        angular_velocity = bodies.angular_velocities[i];
+        split_linear_velocity = glm::vec3(0.0f);
+        split_angular_velocity = glm::vec3(0.0f);
+        delta_position = glm::vec3(0.0f);
+        delta_rotation = glm::vec3(0.0f);
+        inverse_inertia = bodies.get_global_inverse_inertia(i);
+        inv_mass = bodies.inv_masses[i];
+        is_static = bodies.is_static(i);
+    }
+    void store(BodyStorage& bodies, size_t i) const {
+        bodies.linear_velocities[i] = linear_velocity;
+        bodies.angular_velocities[i] = angular_velocity;
+        bodies.split_linear_velocities[i] = split_linear_velocity;
+        bodies.split_angular_velocities[i] = split_angular_velocity;
+    }
+
+    // Moves the body on by one substep, the split velocities only last for that substep
+    void integrate(float substep) {
+        delta_position += (linear_velocity + split_linear_velocity) * substep;
+        delta_rotation += (angular_velocity + split_angular_velocity) * substep;
+        split_linear_velocity = split_angular_velocity = glm::vec3(0.0f);
+    }
+};
+
+inline vec12 combined_velocity_vector(const SolverBody& a, const SolverBody& b) { 
     return vec12(a.linear_velocity, a.angular_velocity, b.linear_velocity, b.angular_velocity);
 }
 
+inline vec12 combined_split_velocity_vector(const SolverBody& a, const SolverBody& b) {
+    return vec12(a.split_linear_velocity, a.split_angular_velocity, b.split_linear_velocity, b.split_angular_velocity);
+}
+
 class MassMatrix { // Actually it's the inverse
     public:
-        constexpr MassMatrix(const Object& a, const Object& b) 
-            : inertia_a(a.global_inverse_inertia), inertia_b(b.global_inverse_inertia), mass_a(a.inv_mass), mass_b(b.inv_mass) {}
+        constexpr MassMatrix(const SolverBody& a, const SolverBody& b) 
+            : inertia_a(a.inverse_inertia), inertia_b(b.inverse_inertia), mass_a(a.inv_mass), mass_b(b.inv_mass) {}
     
         vec12 operator*(const vec12& v) const {
             return vec12(
@@ -73,32 +119,264 @@ inline vec12 apply_constraint(const vec12& J, const MassMatrix& M, const float l
     return M * (J * lambda);
 }
 
-inline void set_velocity(Object& a, Object& b, const vec12& v) {
-    a.linear_velocity  = glm::vec3(v[ 0], v[ 1], v[ 2]);
-    a.angular_velocity = glm::vec3(v[ 3], v[ 4], v[ 5]);
-    b.linear_velocity  = glm::vec3(v[ 6], v[ 7], v[ 8]);
-    b.angular_velocity = glm::vec3(v[ 9], v[10], v[11]);
+// Spring-damper behaviour of a constraint's position correction (Catto, "Soft Constraints"), a frequency in Hz and
+// a damping ratio (1 is critically damped) that behave the same at any step size. A frequency of 0 keeps the
+// rigid constraint that corrects Scene::baumgarte_bias of its position error per step, which depends on the step size.
+struct Softness {
+    float frequency = 0.0f;
+    float damping_ratio = 1.0f;
+};
+
+// What a Softness comes down to for a step. The impulses are mass_scale times those of the rigid constraint,
+// minus impulse_scale times the impulse accumulated so far. The defaults are a rigid constraint without position error.
+struct SoftCoefficients {
+    float bias_rate = 0.0f; // Velocity bias per unit of position error
+    float mass_scale = 1.0f;
+    float impulse_scale = 0.0f;
+
+    SoftCoefficients() = default;
+    SoftCoefficients(const Softness& softness, float baumgarte_bias, float step_size) {
+        if (softness.frequency == 0.0f) {
+            bias_rate = baumgarte_bias / step_size;
+            return;
+        }
+        float omega = 2.0f * glm::pi<float>() * softness.frequency;
+        float a1 = 2.0f * softness.damping_ratio + step_size * omega;
+        float a2 = step_size * omega * a1;
+        float a3 = 1.0f / (1.0f + a2);
+        bias_rate = omega / a1;
+        mass_scale = a2 * a3;
+        impulse_scale = a3;
+    }
+};
+
+// Constraint rows with everything that stays the same during the solver iterations of a step
+// (positions and orientations only change afterwards) computed once up front.
+// BLOCKS are the parts of the Jacobian that can be non-zero at all, the STATIC blocks passed to
+// resolve and apply are the ones of static bodies and have been folded away (see fold_static).
+// The position bias is either added to the bias or, with split impulses, solved against the split velocities
+// (static bodies never have one, so nothing was folded into it).
+template<size_t L, unsigned BLOCKS = ALL_BLOCKS>
+struct ConstraintRows {
+    typedef glm::vec<(glm::length_t)L, float> Vec;
+
+    std::array<vec12, L> J;
+    std::array<vec12, L> MJ; // Velocity change per unit of impulse along each row
+    glm::mat<(glm::length_t)L, (glm::length_t)L, float> inverse_effective_mass;
+    Vec bias;
+    Vec position_bias;
+    Vec response; // Velocity change along each row per unit of its own impulse, the diagonal of J * M * J^T
+    SoftCoefficients soft;
+
+    void prepare(const std::array<vec12, L>& jacobian, const MassMatrix& M, Vec b, Vec position_error = Vec(0.0f), SoftCoefficients coefficients = {}) {
+        J = jacobian;
+        for (size_t i = 0; i<L; i++) {
+            MJ[i] = M * J[i];
+            response[(glm::length_t)i] = J[i].dot(MJ[i]);
+        }
+        inverse_effective_mass = compute_inverse_effective_mass(J, M);
+        bias = b;
+        soft = coefficients;
+        position_bias = soft.bias_rate * position_error;
+    }
+
+    // Static bodies keep their velocity during the whole solve, so their part of J * V moves into the bias
+    // and their blocks of J are cleared (MJ is already zero there). Called after prepare.
+    void fold_static(const vec12& V, unsigned static_blocks) {
+        if (!static_blocks) return;
+        for (size_t i = 0; i<L; i++) {
+            vec12 dynamic = J[i];
+            dynamic.clear_blocks(static_blocks);
+            bias[(glm::length_t)i] += (J[i] - dynamic).dot(V);
+            J[i] = dynamic;
+        }
+    }
+
+    template<unsigned STATIC = 0>
+    Vec resolve(const vec12& V) const { return resolve<STATIC>(V, bias); }
+    template<unsigned STATIC>
+    Vec resolve(const vec12& V, Vec b) const {
+        b = -b;
+        for (glm::length_t i = 0; i<L; i++) {
+            b[i] -= J[i].template sparse_dot<BLOCKS & ~STATIC>(V);
+        }
+        return inverse_effective_mass * b;
+    }
+    // Softened by the coefficients, impulse_sum is what the rows have accumulated so far
+    template<unsigned STATIC>
+    Vec resolve(const vec12& V, Vec b, Vec impulse_sum) const {
+        return soft.mass_scale * resolve<STATIC>(V, b) - soft.impulse_scale * impulse_sum;
+    }
+
+    // The bodies moved with velocities V for a substep, to first order that changes the position error by J * V times the substep
+    void advance(const vec12& V, float substep) {
+        for (glm::length_t i = 0; i<L; i++) {
+            position_bias[i] += soft.bias_rate * substep * J[i].dot(V);
+        }
+    }
+
+    template<unsigned STATIC = 0>
+    void apply(vec12& V, Vec lambda) const {
+        for (size_t i = 0; i<L; i++) {
+            V.sparse_add<BLOCKS & ~STATIC>(MJ[i], lambda[(glm::length_t)i]);
+        }
+    }
+
+    // Largest velocity error that applying lambda corrected, in m/s or rad/s
+    float residual(Vec lambda) const {
+        float result = 0.0f;
+        for (glm::length_t i = 0; i<L; i++) {
+            result = glm::max(result, std::abs(lambda[i]) * response[i]);
+        }
+        return result;
+    }
+};
+
+template<unsigned BLOCKS = ALL_BLOCKS>
+struct ConstraintRow {
+    vec12 J;
+    vec12 MJ;
+    float inverse_effective_mass;
+    float bias;
+    float position_bias;
+    SoftCoefficients soft;
+
+    void prepare(const vec12& jacobian, const MassMatrix& M, float b, float position_error = 0.0f, SoftCoefficients coefficients = {}) {
+        J = jacobian;
+        MJ = M * J;
+        inverse_effective_mass = 1.0f / J.dot(MJ);
+        bias = b;
+        soft = coefficients;
+        position_bias = soft.bias_rate * position_error;
+    }
+
+    void fold_static(const vec12& V, unsigned static_blocks) {
+        if (!static_blocks) return;
+        vec12 dynamic = J;
+        dynamic.clear_blocks(static_blocks);
+        bias += (J - dynamic).dot(V);
+        J = dynamic;
+    }
+
+    template<unsigned STATIC = 0>
+    float error(const vec12& V) const { return -bias - J.sparse_dot<BLOCKS & ~STATIC>(V); }
+    template<unsigned STATIC = 0>
+    float resolve(const vec12& V) const { return inverse_effective_mass * error<STATIC>(V); }
+    template<unsigned STATIC = 0>
+    float resolve(const vec12& V, float impulse_sum) const { return soft.mass_scale * resolve<STATIC>(V) - soft.impulse_scale * impulse_sum; }
+    template<unsigned STATIC = 0>
+    float resolve_split(const vec12& P) const { return inverse_effective_mass * (-position_bias - J.sparse_dot<BLOCKS & ~STATIC>(P)); }
+    template<unsigned STATIC = 0>
+    void apply(vec12& V, float lambda) const { V.sparse_add<BLOCKS & ~STATIC>(MJ, lambda); }
+
+    float residual(float lambda) const { return std::abs(lambda) / inverse_effective_mass; }
+};
+
+// Static bodies are skipped, their velocity can't have changed and they may be shared between solver threads
+inline void set_velocity(SolverBody& a, SolverBody& b, const vec12& v) {
+    if (!a.is_static) {
+        a.linear_velocity  = glm::vec3(v[ 0], v[ 1], v[ 2]);
+        a.angular_velocity = glm::vec3(v[ 3], v[ 4], v[ 5]);
+    }
+    if (!b.is_static) {
+        b.linear_velocity  = glm::vec3(v[ 6], v[ 7], v[ 8]);
+        b.angular_velocity = glm::vec3(v[ 9], v[10], v[11]);
+    }
+}
+
+inline void set_split_velocity(SolverBody& a, SolverBody& b, const vec12& v) {
+    if (!a.is_static) {
+        a.split_linear_velocity  = glm::vec3(v[ 0], v[ 1], v[ 2]);
+        a.split_angular_velocity = glm::vec3(v[ 3], v[ 4], v[ 5]);
+    }
+    if (!b.is_static) {
+        b.split_linear_velocity  = glm::vec3(v[ 6], v[ 7], v[ 8]);
+        b.split_angular_velocity = glm::vec3(v[ 9], v[10], v[11]);
+    }
 }
 
 class Constraint {
     public:
-        virtual void apply(const Scene&, float step_size) = 0;
+        virtual ~Constraint() {}
+
+        // Called once per step before prepare, the bodies are indexed by Object::get_body
+        void bind(std::vector<SolverBody>& bodies) {
+            body_a = &bodies[obj_a.get_body()];
+            body_b = &bodies[obj_b.get_body()];
+            static_blocks = (body_a->is_static ? BODY_A_BLOCKS : 0) | (body_b->is_static ? BODY_B_BLOCKS : 0);
+        }
+        // Computes what stays the same during the iterations
+        virtual void prepare(const Scene&, float step_size) = 0;
+        // Called after prepare, joints reapply (factor times) the impulse they ended the previous step with
+        virtual void warm_start(float factor) {}
+        virtual void reset_impulses() {}
+        // Between substeps (see Scene::solver_substeps), moves the position errors on by how far the bodies moved in the last one
+        virtual void advance(float substep) {}
+        // A single solver iteration, only updates the velocities.
+        // Returns the largest velocity error it corrected, which is how far from converged the constraint was.
+        virtual float solve() = 0;
+
+        // Joints that a JointTree can solve directly expose their prepared rows, a count of 0 means they can't be.
+        // Soft joints never can be, the factorisation is of the rigid system.
+        // The position bias is the part of the bias that corrects position errors, with split impulses it's solved separately.
+        static constexpr size_t MAX_DIRECT_ROWS = 6;
+        virtual size_t direct_row_count() const { return 0; }
+        virtual void get_direct_rows(vec12* J, float* bias, float* position_bias) const {}
+        // Impulse applied by a direct solve, accumulated for warm starting
+        virtual void add_direct_impulse(const float* lambda) {}
+
+        Object& get_object_a() const { return obj_a; }
+        Object& get_object_b() const { return obj_b; }
+        SolverBody* get_body_a() const { return body_a; }
+        SolverBody* get_body_b() const { return body_b; }
+
+        Softness softness; // Contacts take Scene::contact_softness instead
+        bool closes_loop = false; // Set by Scene::build_islands for joints, these are never warm started
 
     protected:
         Constraint(Object& a, Object& b) : obj_a(a), obj_b(b) {}
 
         Object& obj_a;
         Object& obj_b;
+        // Only valid during the solve, velocities are read from and written to these instead of the objects
+        SolverBody* body_a = nullptr;
+        SolverBody* body_b = nullptr;
+        unsigned static_blocks = 0; // Blocks of the Jacobian that belong to static bodies
+
+        // Calls f with the static blocks as a compile-time constant, so that the rows can skip them entirely.
+        // Both bodies being static doesn't happen, such constraints are never part of an island.
+        template<class F>
+        void with_static_blocks(F&& f) const {
+            switch (static_blocks) {
+                case BODY_A_BLOCKS: f(std::integral_constant<unsigned, BODY_A_BLOCKS>()); break;
+                case BODY_B_BLOCKS: f(std::integral_constant<unsigned, BODY_B_BLOCKS>()); break;
+                default:            f(std::integral_constant<unsigned, 0>()); break;
+            }
+        }
 };
 
-class BallSocketJoint : public Constraint {
+class BallSocketJoint final : public Constraint {
     public:
         BallSocketJoint(Object& a, Object& b, glm::vec3 local_a, glm::vec3 local_b) : Constraint(a, b), local_a(local_a), local_b(local_b) {}
 
-        void apply(const Scene&, float step_size) override;
+        void prepare(const Scene&, float step_size) override;
+        void warm_start(float factor) override;
+        void reset_impulses() override { impulse_sum = glm::vec3(0.0f); }
+        void advance(float substep) override;
+        float solve() override;
+
+        size_t direct_row_count() const override { return softness.frequency == 0.0f ? 3 : 0; }
+        void get_direct_rows(vec12* J, float* bias, float* position_bias) const override;
+        void add_direct_impulse(const float* lambda) override { impulse_sum += glm::vec3(lambda[0], lambda[1], lambda[2]); }
+
+        friend class XPBDSolver;
+
     private:
         glm::vec3 local_a;
         glm::vec3 local_b;
+
+        ConstraintRows<3> rows;
+        glm::vec3 impulse_sum = glm::vec3(0.0f);
 };
 
 //class FixedJoint : public Constraint {
@@ -113,12 +391,26 @@ class BallSocketJoint : public Constraint {
 //};
 
 
-class HingeJoint : public Constraint {
+class HingeJoint final : public Constraint {
     public:
         HingeJoint(Object& a, Object& b, glm::vec3 local_a, glm::vec3 local_b, glm::vec3 local_vec_a, glm::vec3 local_vec_b)
             : Constraint(a, b), local_a(local_a), local_b(local_b), local_vec_a(local_vec_a), local_vec_b(local_vec_b) {}
 
-        void apply(const Scene&, float step_size) override;
+        void prepare(const Scene&, float step_size) override;
+        void warm_start(float factor) override;
+        void reset_impulses() override { position_impulse_sum = glm::vec3(0.0f); angle_impulse_sum = glm::vec2(0.0f); }
+        void advance(float substep) override;
+        float solve() override;
+
+        // Position rows first, then the angle rows
+        size_t direct_row_count() const override { return softness.frequency == 0.0f ? 5 : 0; }
+        void get_direct_rows(vec12* J, float* bias, float* position_bias) const override;
+        void add_direct_impulse(const float* lambda) override {
+            position_impulse_sum += glm::vec3(lambda[0], lambda[1], lambda[2]);
+            angle_impulse_sum += glm::vec2(lambda[3], lambda[4]);
+        }
+
+        friend class XPBDSolver;
 
     private:
         glm::vec3 local_a;
@@ -126,27 +418,66 @@ class HingeJoint : public Constraint {
 
         glm::vec3 local_vec_a;
         glm::vec3 local_vec_b;
+
+        ConstraintRows<3> position_rows;
+        ConstraintRows<2, ANGULAR_BLOCKS> angle_rows;
+        glm::vec3 position_impulse_sum = glm::vec3(0.0f);
+        glm::vec2 angle_impulse_sum = glm::vec2(0.0f);
+        // The angle rows are along these, they are rebuilt from the axis every step and can turn a lot when it barely moves
+        std::array<glm::vec3, 2> angle_tangents = { glm::vec3(0.0f), glm::vec3(0.0f) };
+};
+
+// Impulses a contact pair ended a step with, kept to warm start the pair in the next step.
+// The objects are only used as a key and are never dereferenced, they may have been removed since.
+struct ContactCache {
+    const Object* a = nullptr;
+    const Object* b = nullptr;
+
+    static constexpr size_t MAX_CONTACTS = 4; // Same as ContactConstraint::MAX_CONTACTS
+
+    size_t contact_count = 0;
+    glm::vec3 anchors[MAX_CONTACTS];          // Contact point relative to A, in A's local space
+    glm::vec3 normals[MAX_CONTACTS];
+    float normal_impulses[MAX_CONTACTS];
+    glm::vec3 tangent_impulses[MAX_CONTACTS]; // Global space, the tangents themselves are rebuilt from each normal
 };
 
 class ContactConstraint final : public Constraint {
     public:
         ContactConstraint(Object& a, Object& b) : Constraint(a, b) {}
 
+        // Points of one manifold. Adding more than that keeps the deepest point and the others that span the largest area.
+        static constexpr size_t MAX_CONTACTS = ContactCache::MAX_CONTACTS;
+
         void add_contact(glm::vec3 local_a, glm::vec3 local_b, glm::vec3 normal);
 
-        void apply(const Scene&, float step_size) override;
+        // Contacts closer than this (relative to A) with similar normals are treated as the same point
+        static constexpr float WARM_START_DISTANCE = 0.1f;
+        static constexpr float WARM_START_NORMAL_DOT = 0.9f;
+        // With substeps gravity is applied before the solve, so resting contacts are only pushed apart until they
+        // overlap by this much. They would otherwise end up exactly touching and be missed by the next step every so often.
+        static constexpr float SUBSTEP_SLOP = 0.002f;
+
+        // Takes over (factor times) the impulses of matching contacts from the previous step and applies them to the objects
+        void warm_start(const ContactCache& previous, float factor);
+        // Applies the current impulses again, at the start of every substep after the first
+        void warm_start();
+        ContactCache save_cache() const;
+        std::pair<const Object*, const Object*> get_key() const { return { &obj_a, &obj_b }; }
+
+        friend class WideContactSolver;
+        friend class XPBDSolver;
+
+        void prepare(const Scene&, float step_size) override;
+        void advance(float substep) override;
+        float solve() override;
 
         void draw_debug() const;
 
         void dump() const {
-            std::cout << "(" << obj_a.get_name() << "," << obj_b.get_name() << ") ";
-            if (contact_count == 1) {
-                std::cout << contacts[0].penetration << ", " << glm::to_string(contacts[0].offsets[0]) << glm::to_string(contacts[0].offsets[1]) << ", " << normal_impulse_sum.x;
-            } else {
-                std::cout 
-                    << glm::to_string(glm::vec2(contacts[0].penetration, contacts[1].penetration)) << ", " 
-                    << "(" << glm::to_string(contacts[0].offsets[0]) << glm::to_string(contacts[0].offsets[1]) << "," << glm::to_string(contacts[1].offsets[0]) << glm::to_string(contacts[1].offsets[1]) << "), "
-                    << glm::to_string(normal_impulse_sum);
+            std::cout << "(" << obj_a.get_name() << "," << obj_b.get_name() << ")";
+            for (size_t i = 0; i<contact_count; i++) {
+                std::cout << " " << contacts[i].penetration << ", " << glm::to_string(contacts[i].offsets[0]) << glm::to_string(contacts[i].offsets[1]) << ", " << normal_impulse_sum[i] << ";";
             }
             std::cout << std::endl;
         }
@@ -154,14 +485,48 @@ class ContactConstraint final : public Constraint {
     private:
         struct Contact {
             glm::vec3 offsets[2];
+            glm::vec3 anchor; // offsets[0] in A's local space
             glm::vec3 normal;
             glm::vec3 tangents[2];
-            float penetration;
+            float penetration; // Distance between the points along the normal, negative if they overlap
             float closing_velocity;
             glm::vec2 tangent_impulse_sum = glm::vec2(0.0f);
+
+            // Position error the biases are set from, moved on between substeps
+            float separation;
+            float velocity_bias; // Restitution and the folded velocities of static bodies
+
+            ConstraintRow<> normal_row;
+            ConstraintRows<2> tangent_rows;
         };
-        Contact contacts[2];
+        Contact contacts[MAX_CONTACTS];
+        // Inverse effective mass of all normal rows together, top left contact_count x contact_count.
+        // Only if there are several points and they don't (nearly) depend on each other, e.g. four on one face.
+        float normal_block_mass[MAX_CONTACTS][MAX_CONTACTS];
+        bool block_solve = false;
+        // How far the determinant of the normal rows' J * M * J^T may fall below the product of its diagonal for a block solve
+        static constexpr float BLOCK_CONDITION = 1e-3f;
+        bool prepare_normal_block();
+        float friction;
+
+        template<unsigned STATIC>
+        float solve();
+        template<unsigned STATIC>
+        float solve_normals(vec12& V);
+        template<unsigned STATIC>
+        float solve_normals_sequential(vec12& V);
+
+        SoftCoefficients soft; // Of overlapping points
+        float inv_step_size;
+        void set_biases(Contact&);
+
+        // Constraint that ensures that the relative velocity of a contact along direction is 0
+        static vec12 compute_jacobian(glm::vec3 direction, const Contact& contact) {
+            return vec12(-direction, glm::cross(direction, contact.offsets[0]), direction, glm::cross(contact.offsets[1], direction));
+        }
 
-        glm::vec2 normal_impulse_sum = glm::vec2(0.0f);
+        glm::vec4 normal_impulse_sum = glm::vec4(0.0f); // One per contact
+        bool split_impulse = false; // Set by prepare from the scene
+        glm::vec4 split_impulse_sum = glm::vec4(0.0f); // Only for this step, never warm started
         size_t contact_count = 0;
 };
\ No newline at end of file
@@ -12,7 +12,7 @@ class StandardController final: public Controller {
         StandardController(Scene& scene) : Controller(scene) {
             ball = scene.get_object("Sphere");
             seesaw = scene.get_object("SeesawBody");
-            ramp_start = scene.get_object("Sphere.001")->position;
+            ramp_start = scene.get_object("Sphere.001")->position();
 
             add_sweep_surface();
         }
@@ -22,20 +22,21 @@ class StandardController final: public Controller {
             if (key == GLFW_KEY_SPACE && ball) {
                 auto object = try_add_ball(scene.camera_pos);
                 if (object) {
-                    object->linear_velocity = glm::mat3(gen_rotation(scene.camera_rot)) * glm::vec3(0, 0, -10);
+                    object->linear_velocity() = glm::mat3(gen_rotation(scene.camera_rot)) * glm::vec3(0, 0, -10);
                 }
             }
         }
 
         void update() override {
             // Remove objects that are too low
-            scene.objects.erase(std::remove_if(scene.objects.begin(), scene.objects.end(), [&](const std::shared_ptr<Object>& object) {
-                return object->position.y < -20.0f;
-            }), scene.objects.end());
+            scene.remove_objects([](const Object& object) {
+                return object.position().y < -20.0f;
+            });
 
             if (seesaw) {
-                auto offset = glm::dot(glm::vec3(1.0, 0.0, 0.0), seesaw->orientation * glm::vec3(0.0, 1.0, 0.0));
-                seesaw->angular_velocity.z = seesaw->angular_velocity.z * 0.98 + offset * 0.5;
+                auto offset = glm::dot(glm::vec3(1.0, 0.0, 0.0), seesaw->orientation() * glm::vec3(0.0, 1.0, 0.0));
+                // Springs back to level, tuned so that the ball the ramp drops launches the other one onto the track
+                seesaw->angular_velocity().z = seesaw->angular_velocity().z * 0.98 + offset * 12.0;
             }
             if (is_triggered) {
                 if (scene.tick > trigger_time + wait) {
@@ -46,13 +47,13 @@ class StandardController final: public Controller {
                 }
             } else {
                 if (scene.tick > trigger_time + 6.0f) {
-                    //std::cout << glm::to_string(ball->position) << std::endl;
-                    //if (ball->position.x < -12.1f) {
-                    if (ball->position.z > 17.5) {
+                    //std::cout << glm::to_string(ball->position()) << std::endl;
+                    //if (ball->position().x < -12.1f) {
+                    if (ball->position().z > 17.5) {
                         trigger_time = scene.tick;
                         //wait = 0.1f;
                         wait = 0.185f;
-                        auto velocity = glm::length(ball->linear_velocity);
+                        auto velocity = glm::length(ball->linear_velocity());
 
                         auto velocity_diff = velocity - 6.19398f;
 
@@ -89,15 +90,15 @@ class StandardController final: public Controller {
 
             auto object = std::make_shared<Object>(shape, shape, nullptr);
             object->colour = glm::vec3(1.0, 0.0, 0.0);
-            object->position = glm::vec3(0.0, 0.0, 25.0);
+            object->position() = glm::vec3(0.0, 0.0, 25.0);
             object->reuse_shadow = true;
-            scene.objects.push_back(object);
+            scene.add_object(object);
         }
 
         std::shared_ptr<Object> try_add_ball(glm::vec3 pos) {
             auto new_ball = std::make_shared<Object>(*ball);
 
-            new_ball->position = pos;
+            new_ball->position() = pos;
             new_ball->update_transform();
 
             auto bounds = new_ball->get_physics_bounds();
@@ -105,9 +106,9 @@ class StandardController final: public Controller {
                 return {};
             }
 
-            new_ball->angular_velocity = new_ball->linear_velocity = glm::vec3(0.0f);
+            new_ball->angular_velocity() = new_ball->linear_velocity() = glm::vec3(0.0f);
 
-            scene.objects.push_back(new_ball);
+            scene.add_object(new_ball);
 
             return new_ball;
         }
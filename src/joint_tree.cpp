@@ -0,0 +1,350 @@
+#include "joint_tree.h"
+
+#include <unordered_map>
+#include <cmath>
+
+#undef min
+#undef max
+
+// Gauss-Jordan with partial pivoting, false if the matrix is singular
+template<size_t N>
+static bool invert(const float (&m)[N][N], float (&result)[N][N], size_t n) {
+    float a[N][2*N];
+    for (size_t i = 0; i<n; i++) {
+        for (size_t j = 0; j<n; j++) {
+            a[i][j] = m[i][j];
+            a[i][n + j] = i == j ? 1.0f : 0.0f;
+        }
+    }
+
+    for (size_t col = 0; col<n; col++) {
+        size_t pivot = col;
+        for (size_t row = col + 1; row<n; row++) {
+            if (std::abs(a[row][col]) > std::abs(a[pivot][col])) pivot = row;
+        }
+        if (std::abs(a[pivot][col]) < 1e-12f) return false;
+        if (pivot != col) {
+            for (size_t j = 0; j<2*n; j++) std::swap(a[col][j], a[pivot][j]);
+        }
+
+        float scale = 1.0f / a[col][col];
+        for (size_t j = 0; j<2*n; j++) a[col][j] *= scale;
+        for (size_t row = 0; row<n; row++) {
+            if (row == col || a[row][col] == 0.0f) continue;
+            float factor = a[row][col];
+            for (size_t j = 0; j<2*n; j++) a[row][j] -= factor * a[col][j];
+        }
+    }
+
+    for (size_t i = 0; i<n; i++) {
+        for (size_t j = 0; j<n; j++) {
+            result[i][j] = a[i][n + j];
+        }
+    }
+    return true;
+}
+
+// Mass and inertia have to be finite and non-zero for the body's block of the system to be invertible
+static bool has_mass_matrix(const SolverBody& body) {
+    return body.inv_mass > 0.0f && std::abs(glm::determinant(body.inverse_inertia)) > 0.0f;
+}
+
+static bool is_anchor(const Constraint& joint) {
+    return joint.get_body_a()->is_static || joint.get_body_b()->is_static;
+}
+
+static SolverBody* dynamic_body(const Constraint& joint) {
+    return joint.get_body_a()->is_static ? joint.get_body_b() : joint.get_body_a();
+}
+
+void JointTree::split(const std::vector<Constraint*>& joints, std::vector<JointTree>& trees, std::vector<uint8_t>& iterative) {
+    // Union find over the dynamic bodies, joints connect their two bodies
+    std::unordered_map<const SolverBody*, size_t> indices;
+    std::vector<size_t> parents;
+    std::vector<size_t> sizes; // Of each body's node
+    auto index_of = [&](const SolverBody* body) {
+        auto [it, inserted] = indices.try_emplace(body, parents.size());
+        if (inserted) {
+            parents.push_back(parents.size());
+            sizes.push_back(6);
+        }
+        return it->second;
+    };
+    auto find = [&](size_t i) {
+        while (parents[i] != i) {
+            parents[i] = parents[parents[i]];
+            i = parents[i];
+        }
+        return i;
+    };
+
+    for (auto joint : joints) {
+        size_t a = index_of(dynamic_body(*joint));
+        if (is_anchor(*joint)) {
+            sizes[a] += joint->direct_row_count();
+        } else {
+            parents[find(index_of(joint->get_body_b()))] = find(a);
+        }
+    }
+
+    // Joints between two dynamic bodies are the edges, which a tree has one less of than bodies
+    struct Component {
+        size_t bodies = 0;
+        size_t edges = 0;
+        bool direct = true;
+        std::vector<Constraint*> joints;
+    };
+    std::unordered_map<size_t, Component> components;
+    for (auto [body, index] : indices) {
+        auto& component = components[find(index)];
+        component.bodies++;
+        if (!has_mass_matrix(*body) || sizes[index] > MAX_SIZE) component.direct = false;
+    }
+    for (auto joint : joints) {
+        auto& component = components[find(indices[dynamic_body(*joint)])];
+        if (!is_anchor(*joint)) component.edges++;
+        if (joint->direct_row_count() == 0) component.direct = false;
+        component.joints.push_back(joint);
+    }
+
+    iterative.resize(joints.size());
+    for (size_t i = 0; i<joints.size(); i++) {
+        auto& component = components[find(indices[dynamic_body(*joints[i])])];
+        iterative[i] = !component.direct || component.edges + 1 != component.bodies;
+    }
+    for (auto& [root, component] : components) {
+        if (component.direct && component.edges + 1 == component.bodies) trees.push_back(JointTree(component.joints));
+    }
+}
+
+JointTree::JointTree(const std::vector<Constraint*>& joints) {
+    // Bodies first then joints, edges only go between a body and a joint
+    std::unordered_map<const SolverBody*, size_t> body_nodes;
+    std::vector<Node> graph;
+    for (auto joint : joints) {
+        for (auto body : { joint->get_body_a(), joint->get_body_b() }) {
+            if (body->is_static || body_nodes.count(body)) continue;
+            body_nodes[body] = graph.size();
+            graph.emplace_back();
+            graph.back().body = body;
+            graph.back().size = 6;
+        }
+    }
+
+    std::vector<std::vector<std::pair<size_t, size_t>>> edges(graph.size()); // Neighbour and side of the joint
+    for (auto joint : joints) {
+        if (is_anchor(*joint)) {
+            auto& node = graph[body_nodes[dynamic_body(*joint)]];
+            assert(node.joint_count < 2);
+            node.joints[node.joint_count++] = joint;
+            node.size += joint->direct_row_count();
+            continue;
+        }
+
+        size_t index = graph.size();
+        graph.emplace_back();
+        graph.back().joints[0] = joint;
+        graph.back().joint_count = 1;
+        graph.back().size = joint->direct_row_count();
+
+        edges.emplace_back();
+        SolverBody* bodies[2] = { joint->get_body_a(), joint->get_body_b() };
+        for (size_t side = 0; side<2; side++) {
+            size_t body = body_nodes[bodies[side]];
+            edges[index].push_back({ body, side });
+            edges[body].push_back({ index, side });
+        }
+    }
+
+    // Post order from the first body, iterative since chains can be long
+    std::vector<bool> visited(graph.size(), false);
+    std::vector<std::pair<size_t, size_t>> stack = { { 0, 0 } }; // Node and next edge
+    visited[0] = true;
+    nodes.reserve(graph.size());
+    std::vector<size_t> order(graph.size());
+    while (!stack.empty()) {
+        auto& [node, edge] = stack.back();
+        if (edge < edges[node].size()) {
+            auto [neighbour, side] = edges[node][edge++];
+            if (visited[neighbour]) continue;
+            visited[neighbour] = true;
+
+            graph[neighbour].parent = node;
+            graph[neighbour].side = side;
+            stack.push_back({ neighbour, 0 });
+        } else {
+            order[node] = nodes.size();
+            nodes.push_back(graph[node]);
+            stack.pop_back();
+        }
+    }
+    for (auto& node : nodes) {
+        if (node.parent != NONE) node.parent = order[node.parent];
+    }
+}
+
+void JointTree::load_rows() {
+    for (auto& node : nodes) {
+        size_t row = node.first_row();
+        for (size_t i = 0; i<node.joint_count; i++) {
+            node.joints[i]->get_direct_rows(node.J + row, node.bias + row, node.position_bias + row);
+            row += node.joints[i]->direct_row_count();
+        }
+    }
+}
+
+void JointTree::factor(bool split) {
+    split_impulse = split;
+    load_rows();
+    // Children are accumulated into each node's D_inverse, before it is inverted
+    for (auto& node : nodes) {
+        for (size_t i = 0; i<node.size; i++) {
+            for (size_t j = 0; j<node.size; j++) node.D_inverse[i][j] = 0.0f;
+        }
+    }
+
+    factored = true;
+    for (auto& node : nodes) {
+        Block D;
+        for (size_t i = 0; i<node.size; i++) {
+            for (size_t j = 0; j<node.size; j++) D[i][j] = node.D_inverse[i][j];
+        }
+        // Body nodes are [M J^T; J 0] with the joints to static bodies, joint nodes only have the zero block
+        if (node.body) {
+            float mass = 1.0f / node.body->inv_mass;
+            glm::mat3 inertia = glm::inverse(node.body->inverse_inertia);
+            for (size_t i = 0; i<3; i++) {
+                D[i][i] += mass;
+                for (size_t j = 0; j<3; j++) D[3 + i][3 + j] += inertia[(glm::length_t)j][(glm::length_t)i];
+            }
+        }
+        size_t row = node.first_row();
+        for (size_t n = 0; n<node.joint_count; n++) {
+            auto joint = node.joints[n];
+            MassMatrix M(*joint->get_body_a(), *joint->get_body_b());
+            size_t offset = joint->get_body_a() == node.body ? 0 : 6;
+            for (size_t end = row + joint->direct_row_count(); row<end; row++) {
+                D[row][row] -= REGULARISATION * node.J[row].dot(M * node.J[row]);
+                if (!node.body) continue;
+
+                for (size_t j = 0; j<6; j++) {
+                    D[row][j] += node.J[row][offset + j];
+                    D[j][row] += node.J[row][offset + j];
+                }
+            }
+        }
+        if (!invert(D, node.D_inverse, node.size)) {
+            factored = false;
+            return;
+        }
+        if (node.parent == NONE) continue;
+
+        // The Jacobian of whichever is the joint, restricted to the velocities of whichever is the body
+        auto& parent = nodes[node.parent];
+        for (size_t i = 0; i<node.size; i++) {
+            for (size_t j = 0; j<parent.size; j++) {
+                if (node.body) {
+                    node.H[i][j] = i < 6 ? parent.J[j][node.side * 6 + i] : 0.0f;
+                } else {
+                    node.H[i][j] = j < 6 ? node.J[i][node.side * 6 + j] : 0.0f;
+                }
+            }
+        }
+
+        for (size_t i = 0; i<node.size; i++) {
+            for (size_t j = 0; j<parent.size; j++) {
+                float sum = 0.0f;
+                for (size_t k = 0; k<node.size; k++) sum += node.D_inverse[i][k] * node.H[k][j];
+                node.L[i][j] = sum;
+            }
+        }
+        // Parent block -= H^T * D_inverse * H
+        for (size_t i = 0; i<parent.size; i++) {
+            for (size_t j = 0; j<parent.size; j++) {
+                float sum = 0.0f;
+                for (size_t k = 0; k<node.size; k++) sum += node.H[k][i] * node.L[k][j];
+                parent.D_inverse[i][j] -= sum;
+            }
+        }
+    }
+}
+
+float JointTree::solve() {
+    float residual = 0.0f;
+    if (!factored) {
+        for (auto& node : nodes) {
+            for (size_t i = 0; i<node.joint_count; i++) residual = std::max(residual, node.joints[i]->solve());
+        }
+        return residual;
+    }
+
+    residual = solve(false);
+    if (split_impulse) residual = std::max(residual, solve(true));
+    return residual;
+}
+
+// Without split impulses the velocities get the position biases too, otherwise the same system is
+// solved a second time for the split velocities with only the position biases, and without accumulating the impulses
+float JointTree::solve(bool split) {
+    float residual = 0.0f;
+
+    // Right hand side, zero for velocities and the velocity error for joint rows
+    for (auto& node : nodes) {
+        size_t row = node.first_row();
+        for (size_t i = 0; i<row; i++) node.x[i] = 0.0f;
+        for (size_t i = 0; i<node.joint_count; i++) {
+            auto joint = node.joints[i];
+            auto& a = *joint->get_body_a();
+            auto& b = *joint->get_body_b();
+            vec12 V = split ? combined_split_velocity_vector(a, b) : combined_velocity_vector(a, b);
+            for (size_t end = row + joint->direct_row_count(); row<end; row++) {
+                float bias = split ? node.position_bias[row] : split_impulse ? node.bias[row] : node.bias[row] + node.position_bias[row];
+                node.x[row] = -bias - node.J[row].dot(V);
+                residual = std::max(residual, std::abs(node.x[row]));
+            }
+        }
+    }
+
+    for (auto& node : nodes) {
+        float y[MAX_SIZE];
+        for (size_t i = 0; i<node.size; i++) {
+            y[i] = 0.0f;
+            for (size_t k = 0; k<node.size; k++) y[i] += node.D_inverse[i][k] * node.x[k];
+        }
+        for (size_t i = 0; i<node.size; i++) node.x[i] = y[i];
+
+        if (node.parent == NONE) continue;
+        auto& parent = nodes[node.parent];
+        for (size_t j = 0; j<parent.size; j++) {
+            for (size_t k = 0; k<node.size; k++) parent.x[j] -= node.H[k][j] * node.x[k];
+        }
+    }
+    for (size_t n = nodes.size(); n-- > 0;) {
+        auto& node = nodes[n];
+        if (node.parent == NONE) continue;
+        auto& parent = nodes[node.parent];
+        for (size_t i = 0; i<node.size; i++) {
+            for (size_t k = 0; k<parent.size; k++) node.x[i] -= node.L[i][k] * parent.x[k];
+        }
+    }
+
+    // Bodies get the velocity change, joints the negated impulse
+    for (auto& node : nodes) {
+        if (node.body && split) {
+            node.body->split_linear_velocity  += glm::vec3(node.x[0], node.x[1], node.x[2]);
+            node.body->split_angular_velocity += glm::vec3(node.x[3], node.x[4], node.x[5]);
+        } else if (node.body) {
+            node.body->linear_velocity  += glm::vec3(node.x[0], node.x[1], node.x[2]);
+            node.body->angular_velocity += glm::vec3(node.x[3], node.x[4], node.x[5]);
+        }
+        if (split) continue;
+
+        size_t row = node.first_row();
+        for (size_t i = 0; i<node.joint_count; i++) {
+            float lambda[Constraint::MAX_DIRECT_ROWS];
+            for (size_t j = 0; j<node.joints[i]->direct_row_count(); j++) lambda[j] = -node.x[row++];
+            node.joints[i]->add_direct_impulse(lambda);
+        }
+    }
+    return residual;
+}
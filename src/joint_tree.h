@@ -0,0 +1,63 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include "constraint.h"
+
+// Solves a group of joints exactly instead of iteratively, by factoring the block sparse system
+// [M J^T; J 0] in linear time (Baraff, "Linear-Time Dynamics using Lagrange Multipliers").
+// That only works without fill-in if the graph of dynamic bodies and the joints between them is a tree.
+// Joints to static bodies are solved together with their dynamic body, so a chain that hangs from
+// the ground at both ends still is one.
+class JointTree {
+    public:
+        // Splits joints (prepared, bound to their bodies) into trees that can be solved directly and the rest,
+        // iterative is set for each of the joints that is in no tree
+        static void split(const std::vector<Constraint*>& joints, std::vector<JointTree>& trees, std::vector<uint8_t>& iterative);
+
+        // Once per step after prepare, falls back to solving the joints one by one if the system is singular.
+        // With split impulses the position errors are solved for the split velocities separately.
+        void factor(bool split_impulse);
+        // Takes over the joints' prepared rows, which factor already does. Only needed again for the new biases
+        // after Constraint::advance, the Jacobians and so the factorisation stay the same between substeps.
+        void load_rows();
+        // Satisfies all joint rows at once for the current velocities, returns the largest velocity error there was
+        float solve();
+
+    private:
+        static constexpr size_t NONE = (size_t)-1;
+        static constexpr size_t MAX_SIZE = 12; // A body's 6 velocities and the rows of the joints that tie it to static bodies
+        // Relative compliance of every row, keeps (nearly) redundant rows like those of a taut chain from making the system singular
+        static constexpr float REGULARISATION = 1e-4f;
+
+        typedef float Block[MAX_SIZE][MAX_SIZE];
+
+        struct Node {
+            SolverBody* body = nullptr; // Body nodes start with the body's velocities, joint nodes have no body
+            Constraint* joints[2] = {};
+            size_t joint_count = 0;
+            size_t size = 0;
+            size_t parent = NONE;
+            size_t side = 0; // Of the joint (0 for A, 1 for B) that the body is on, for the edge to the parent
+
+            vec12 J[MAX_SIZE]; // Rows of the joints, after the body's velocities
+            float bias[MAX_SIZE];
+            float position_bias[MAX_SIZE];
+
+            Block H;         // Off-diagonal block to the parent, size x parent size
+            Block D_inverse; // Inverse of the diagonal block of the factorisation
+            Block L;         // D_inverse * H
+            float x[MAX_SIZE];
+
+            size_t first_row() const { return body ? 6 : 0; }
+        };
+
+        JointTree(const std::vector<Constraint*>& joints);
+
+        std::vector<Node> nodes; // Children before their parent, the root is last
+        bool factored = false;
+        bool split_impulse = false;
+
+        float solve(bool split);
+};
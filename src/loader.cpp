@@ -1,4 +1,5 @@
 #include "loader.h"
+#include "bvh_cache.h"
 
 #include <fstream>
 #include <iostream>
@@ -76,8 +77,8 @@ std::shared_ptr<ShapeCollider> ResourceManager::load_shape_collider(std::string
     auto shape = load_shape(filename);
 
     std::shared_ptr<ShapeCollider> result;
-    if (false) { //(shape->get_vertices().size() > 1000) {
-        result = std::make_shared<BVHShapeCollider>(shape);
+    if (shape->get_faces().size() >= BVHShapeCollider::LINEAR_BUILD_THRESHOLD) {
+        result = load_bvh_shape_collider(shape, canonical_path);
     } else {
         result = std::make_shared<ShapeCollider>(shape);
     }
@@ -86,6 +87,40 @@ std::shared_ptr<ShapeCollider> ResourceManager::load_shape_collider(std::string
     return result;
 }
 
+template<class Q>
+static std::shared_ptr<BVHShapeCollider> load_cached_bvh_shape_collider(std::shared_ptr<Shape> shape, BVHStorage storage,
+        const std::string& cache_filename, uint64_t hash, const CompactBVHTree<Q>& (BVHShapeCollider::*get_tree)() const) {
+    size_t face_count = shape->get_faces().size();
+
+    CompactBVHTree<Q> tree;
+    ShapeProperties properties;
+    if (load_bvh_cache(cache_filename, hash, face_count, tree, properties)) {
+        return std::make_shared<BVHShapeCollider>(shape, properties, std::move(tree));
+    }
+
+    // Missing or stale, build it and replace the cache
+    auto result = std::make_shared<BVHShapeCollider>(shape, storage);
+    if (!save_bvh_cache(cache_filename, hash, face_count, (result.get()->*get_tree)(), result->get_properties())) {
+        std::cerr << "Failed to write BVH cache " << cache_filename << std::endl;
+    }
+    return result;
+}
+
+std::shared_ptr<BVHShapeCollider> ResourceManager::load_bvh_shape_collider(std::shared_ptr<Shape> shape, const std::string& filename) {
+    // Only the quantised trees are flat enough to be mapped straight from disk
+    if (!bvh_cache_enabled || bvh_storage == BVHStorage::POINTERS) {
+        return std::make_shared<BVHShapeCollider>(shape, bvh_storage);
+    }
+
+    std::string cache_filename = filename + ".bvh";
+    uint64_t hash = hash_file(filename);
+    if (bvh_storage == BVHStorage::QUANTISED_8) {
+        return load_cached_bvh_shape_collider<uint8_t>(shape, bvh_storage, cache_filename, hash, &BVHShapeCollider::get_compact_tree_8);
+    } else {
+        return load_cached_bvh_shape_collider<uint16_t>(shape, bvh_storage, cache_filename, hash, &BVHShapeCollider::get_compact_tree_16);
+    }
+}
+
 std::shared_ptr<Texture> ResourceManager::load_texture(std::string filename) {
     filename = fs::canonical(path_prefix / filename).string();
     
@@ -136,6 +171,88 @@ void ResourceManager::load_scene(Scene& scene, std::string filename) {
         scene.ambient_colour = {0.2, 0.2, 0.2};
     }
 
+    if (data.contains("warm_start_factor")) {
+        data["warm_start_factor"].get_to(scene.warm_start_factor);
+    } else {
+        scene.warm_start_factor = 1.0f;
+    }
+
+    if (data.contains("backend")) {
+        std::string backend = data["backend"];
+        assert(backend == "impulse" || backend == "xpbd");
+        scene.backend = backend == "xpbd" ? Scene::Backend::XPBD : Scene::Backend::IMPULSE;
+    } else {
+        scene.backend = Scene::Backend::IMPULSE;
+    }
+
+    if (data.contains("xpbd_substeps")) {
+        data["xpbd_substeps"].get_to(scene.xpbd_substeps);
+    } else {
+        scene.xpbd_substeps = 4;
+    }
+
+    if (data.contains("xpbd_compliance")) {
+        data["xpbd_compliance"].get_to(scene.xpbd_compliance);
+    } else {
+        scene.xpbd_compliance = 0.0f;
+    }
+
+    if (data.contains("speculative_contacts")) {
+        data["speculative_contacts"].get_to(scene.speculative_contacts);
+    } else {
+        scene.speculative_contacts = true;
+    }
+
+    if (data.contains("contact_frequency")) {
+        data["contact_frequency"].get_to(scene.contact_softness.frequency);
+    } else {
+        scene.contact_softness.frequency = 0.0f;
+    }
+
+    if (data.contains("contact_damping_ratio")) {
+        data["contact_damping_ratio"].get_to(scene.contact_softness.damping_ratio);
+    } else {
+        scene.contact_softness.damping_ratio = 1.0f;
+    }
+
+    if (data.contains("split_impulse")) {
+        data["split_impulse"].get_to(scene.split_impulse);
+    } else {
+        scene.split_impulse = false;
+    }
+
+    if (data.contains("solver_steps")) {
+        data["solver_steps"].get_to(scene.solver_steps);
+    } else {
+        scene.solver_steps = 8;
+    }
+
+    if (data.contains("solver_tolerance")) {
+        data["solver_tolerance"].get_to(scene.solver_tolerance);
+    } else {
+        scene.solver_tolerance = 1e-3f;
+    }
+
+    // Substeps only pay off with a longer step, e.g. 1/60 s with 3 substeps instead of 1/180 s
+    if (data.contains("max_step_size")) {
+        data["max_step_size"].get_to(scene.max_step_size);
+        assert(scene.max_step_size > 0.0f);
+    } else {
+        scene.max_step_size = 1.0f / 180.0f;
+    }
+
+    if (data.contains("solver_substeps")) {
+        data["solver_substeps"].get_to(scene.solver_substeps);
+    } else {
+        scene.solver_substeps = 1;
+    }
+
+    if (data.contains("direct_joints")) {
+        data["direct_joints"].get_to(scene.direct_joints);
+    } else {
+        scene.direct_joints = true;
+    }
+
     if (data.contains("skybox")) {
         for (size_t i = 0; i<scene.skybox.size(); i++) {
             //scene.skybox[i] = load_texture(data["skybox"].at(i));
@@ -182,16 +299,16 @@ void ResourceManager::load_scene(Scene& scene, std::string filename) {
         }
 
         if (elem.contains("position")) {
-            elem["position"].get_to(object->position);
+            elem["position"].get_to(object->position());
             object->update_transform();
         }
 
         if (elem.contains("linear_velocity")) {
-            elem["linear_velocity"].get_to(object->linear_velocity);
+            elem["linear_velocity"].get_to(object->linear_velocity());
         }
 
         if (elem.contains("angular_velocity")) {
-            elem["angular_velocity"].get_to(object->angular_velocity);
+            elem["angular_velocity"].get_to(object->angular_velocity());
         }
 
         if (elem.contains("reuse_shadow")) elem["reuse_shadow"].get_to(object->reuse_shadow);
@@ -220,6 +337,7 @@ void ResourceManager::load_scene(Scene& scene, std::string filename) {
 
         if (elem.contains("friction")) object->friction = elem["friction"];
         if (elem.contains("restitution")) object->restitution = elem["restitution"];
+        if (elem.contains("ccd")) elem["ccd"].get_to(object->ccd);
 
         if (elem.contains("texture")) {
             object->texture = load_texture(elem["texture"]);
@@ -229,7 +347,7 @@ void ResourceManager::load_scene(Scene& scene, std::string filename) {
             elem["colour"].get_to(object->colour);
         }
 
-        scene.objects.push_back(object);
+        scene.add_object(object);
     }
 
     if (data.contains("constraints")) {
@@ -240,11 +358,16 @@ void ResourceManager::load_scene(Scene& scene, std::string filename) {
 
             assert(obj_a != obj_b);
 
+            Softness softness;
+            if (elem.contains("frequency")) elem["frequency"].get_to(softness.frequency);
+            if (elem.contains("damping_ratio")) elem["damping_ratio"].get_to(softness.damping_ratio);
+
             if (type == "ball_and_socket") {
                 glm::vec3 local_a = elem.at("locals")[0];
                 glm::vec3 local_b = elem.at("locals")[1];
 
-                scene.constraints.push_back(std::move(std::make_unique<BallSocketJoint>(*obj_a, *obj_b, local_a, local_b)));
+                scene.ball_socket_joints.emplace_back(*obj_a, *obj_b, local_a, local_b);
+                scene.ball_socket_joints.back().softness = softness;
             } else if (type == "hinge") {
                 glm::vec3 local_a = elem.at("locals")[0];
                 glm::vec3 local_b = elem.at("locals")[1];
@@ -252,7 +375,8 @@ void ResourceManager::load_scene(Scene& scene, std::string filename) {
                 glm::vec3 local_vec_a = elem.at("vectors")[0];
                 glm::vec3 local_vec_b = elem.at("vectors")[1];
 
-                scene.constraints.push_back(std::move(std::make_unique<HingeJoint>(*obj_a, *obj_b, local_a, local_b, local_vec_a, local_vec_b)));
+                scene.hinge_joints.emplace_back(*obj_a, *obj_b, local_a, local_b, local_vec_a, local_vec_b);
+                scene.hinge_joints.back().softness = softness;
             } else {
                 assert(false);
             }
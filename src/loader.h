@@ -20,6 +20,16 @@ class ResourceManager {
             path_prefix = path;
         }
 
+        // How BVHs of large mesh colliders are stored, only affects colliders loaded after the call
+        void set_bvh_storage(BVHStorage storage) {
+            bvh_storage = storage;
+        }
+
+        // Quantised BVHs are cached next to their mesh (as <mesh>.bvh) and mapped on later loads
+        void set_bvh_cache_enabled(bool enabled) {
+            bvh_cache_enabled = enabled;
+        }
+
         void flush();
 
         std::shared_ptr<Shape> load_shape(std::string filename);
@@ -32,10 +42,13 @@ class ResourceManager {
         ResourceManager() {}
 
         fs::path path_prefix = "";
+        BVHStorage bvh_storage = BVHStorage::QUANTISED_16;
+        bool bvh_cache_enabled = true;
 
         std::unordered_map<std::string, std::weak_ptr<Texture>> texture_store;
         std::unordered_map<std::string, std::weak_ptr<ShapeCollider>> shape_collider_store;
         std::unordered_map<std::string, std::weak_ptr<Shape>> shape_store;
 
         std::shared_ptr<Texture> load_skybox_texture(std::string filename);
+        std::shared_ptr<BVHShapeCollider> load_bvh_shape_collider(std::shared_ptr<Shape> shape, const std::string& filename);
 };
\ No newline at end of file
@@ -3,6 +3,7 @@
 #endif
 
 #include <cmath>
+#include <cstring>
 #include <iostream>
 #include <algorithm>
 #include <memory>
@@ -33,6 +34,7 @@ Scene scene;
 int speed = 0;
 bool cursor_captured = false;
 bool paused = false;
+BVHStats bvh_quality; // Of the largest mesh collider, walking its tree every frame would be too slow
 
 void dump_stencil() {
     GLint display[4];
@@ -59,8 +61,12 @@ void key_callback(GLFWwindow*, int key, int, int action, int) {
         ResourceManager::the().load_scene(scene, scene_filename);
         //scene.slow_start();
         scene.controller = make_controller(scene);
+        bvh_quality = scene.largest_bvh_stats();
     } else if (key == GLFW_KEY_O) {
         scene.debug_mode = !scene.debug_mode;
+    } else if (key == GLFW_KEY_B) {
+        std::ofstream file("bvh_stats.json");
+        scene.dump_bvh_stats(file);
     } else if (key == GLFW_KEY_P) {
         paused = !paused;
     } else if (key == GLFW_KEY_T) {
@@ -153,6 +159,7 @@ int main(int argc, char **argv) {
     ResourceManager::the().load_scene(scene, scene_filename);
     //scene.slow_start();
     scene.controller = make_controller(scene);
+    bvh_quality = scene.largest_bvh_stats();
 
     // vec3(-0.066511, 21.718731, -15.570836)vec3(-0.435000, 3.145001, 0.000000)
     scene.camera_pos = glm::vec3(0.0f, 22.0f, -15.5f);
@@ -172,9 +179,21 @@ int main(int argc, char **argv) {
         framerate = (framerate * 0.9) + 0.1 / frame_time;
 
         {
-            char buffer[50];
+            char buffer[400];
             if (scene.debug_mode) {
-                snprintf(buffer, sizeof(buffer), "%s: %.2lf, %.2f", TITLE.c_str(), framerate, scene.tick);
+                // Average BVH work per query over the last frame
+                auto& bvh = scene.bvh_frame_stats;
+                double queries = std::max(bvh.queries, (uint64_t)1);
+                auto& islands = scene.island_stats;
+                auto& solver = scene.solver_stats;
+                snprintf(buffer, sizeof(buffer), "%s: %.2lf, %.2f, BVH %llu queries, %.1f nodes, %.1f leaves, %zu islands (%zu asleep, largest %zu of %zu objects), %zu iterations (residual %.4f)",
+                    TITLE.c_str(), framerate, scene.tick, (unsigned long long)bvh.queries, bvh.nodes_visited / queries, bvh.leaves_tested / queries,
+                    islands.islands, islands.sleeping, islands.largest, islands.objects, solver.iterations, solver.residual);
+                if (bvh_quality.node_count > 0) {
+                    size_t length = strlen(buffer);
+                    snprintf(buffer + length, sizeof(buffer) - length, ", largest BVH SAH %.1f, depth %zu, overlap %.3f",
+                        bvh_quality.sah_cost, bvh_quality.max_depth, bvh_quality.sibling_overlap);
+                }
             } else {
                 snprintf(buffer, sizeof(buffer), "%s: %.2lf", TITLE.c_str(), framerate);
             }
@@ -0,0 +1,73 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef _WIN32
+
+std::shared_ptr<MappedFile> MappedFile::open(const std::string& filename) {
+    std::shared_ptr<MappedFile> result(new MappedFile());
+
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return nullptr;
+    result->file_handle = file;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) return nullptr;
+    result->length = (size_t)size.QuadPart;
+    if (result->length == 0) return result; // Empty files can't be mapped, but there's nothing to read either
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping) return nullptr;
+    result->mapping_handle = mapping;
+
+    result->mapped = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!result->mapped) return nullptr;
+
+    return result;
+}
+
+MappedFile::~MappedFile() {
+    if (mapped) UnmapViewOfFile(mapped);
+    if (mapping_handle) CloseHandle((HANDLE)mapping_handle);
+    if (file_handle) CloseHandle((HANDLE)file_handle);
+}
+
+#else
+
+std::shared_ptr<MappedFile> MappedFile::open(const std::string& filename) {
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    std::shared_ptr<MappedFile> result(new MappedFile());
+    result->length = (size_t)info.st_size;
+    if (result->length > 0) {
+        void* mapped = mmap(nullptr, result->length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            close(fd);
+            return nullptr;
+        }
+        result->mapped = (const uint8_t*)mapped;
+    }
+
+    close(fd); // The mapping stays valid without the descriptor
+    return result;
+}
+
+MappedFile::~MappedFile() {
+    if (mapped) munmap((void*)mapped, length);
+}
+
+#endif
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <cstdint>
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+    public:
+        // Returns nullptr if the file can't be opened or mapped
+        static std::shared_ptr<MappedFile> open(const std::string& filename);
+
+        MappedFile(MappedFile const&) = delete;
+        void operator=(MappedFile const&) = delete;
+
+        ~MappedFile();
+
+        const uint8_t* data() const { return mapped; }
+        size_t size() const { return length; }
+
+    private:
+        MappedFile() {}
+
+        const uint8_t* mapped = nullptr;
+        size_t length = 0;
+
+#ifdef _WIN32
+        void* file_handle = nullptr;
+        void* mapping_handle = nullptr;
+#endif
+};
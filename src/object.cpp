@@ -14,13 +14,29 @@
 
 #include "scene.h"
 
+Object::Object(const Object& other)
+        : colour(other.colour), texture(other.texture), friction(other.friction), restitution(other.restitution), ccd(other.ccd),
+          reuse_shadow(other.reuse_shadow), name(other.name), main_shape(other.main_shape), shadow_shape(other.shadow_shape),
+          collider(other.collider), mass(other.mass) {
+    storage->set_collider(body, collider.get());
+    storage->positions[body] = other.position();
+    storage->orientations[body] = other.orientation();
+    storage->linear_velocities[body] = other.linear_velocity();
+    storage->angular_velocities[body] = other.angular_velocity();
+    storage->inv_masses[body] = other.storage->inv_masses[other.body];
+    storage->local_inverse_inertias[body] = other.storage->local_inverse_inertias[other.body];
+    update_transform();
+}
+
 Object::~Object() {
+    storage->remove(body);
     if (shadow_displaylist) {
         glDeleteLists(shadow_displaylist, 1);
     }
 }
 
 void Object::load_transform() const {
+    auto transform = get_transform();
     glMultMatrixf(&transform[0].x);
 }
 
@@ -68,7 +84,7 @@ void Object::render_shadow(Light light) const {
     if (light.is_point) {
         pos.w = 1.0f;
     }
-    pos = glm::inverse(transform) * pos;
+    pos = glm::inverse(get_transform()) * pos;
     light.pos = glm::vec3(pos.x, pos.y, pos.z);
     if (!light.is_point) {
         light.vec = glm::normalize(light.vec);
@@ -83,19 +99,19 @@ void Object::render_shadow(Light light) const {
 void Object::set_mass(float m) {
     assert(m > 0.0f);
     mass = m;
-    inv_mass = 1.0f / m;
+    storage->inv_masses[body] = 1.0f / m;
 }
 
 void Object::set_density(float density) {
     assert(density > 0.0f);
     assert(collider);
     mass = density * collider->get_volume();
-    inv_mass = 1.0f / mass;
+    storage->inv_masses[body] = 1.0f / mass;
 }
 
 void Object::set_infinite_mass() {
     mass = -1.0f;
-    inv_mass = 0.0f;
+    storage->inv_masses[body] = 0.0f;
 }
 
 void Object::set_inertia_mass(float m) {
@@ -111,52 +127,39 @@ void Object::set_inertia_density(float density) {
 }
 
 void Object::set_inertia(glm::mat3 inertia) {
-    local_inverse_inertia = glm::inverse(inertia);
-    global_inverse_inertia = orientation * local_inverse_inertia * glm::transpose(orientation);
+    storage->local_inverse_inertias[body] = glm::inverse(inertia);
+    storage->rotations_outdated[body] = true;
 }
 
 void Object::set_infinite_inertia() {
-    local_inverse_inertia = global_inverse_inertia = glm::mat3(0.0f);
+    storage->local_inverse_inertias[body] = glm::mat3(0.0f);
+    storage->rotations_outdated[body] = true;
 }
 
 void Object::update_orientation() {
-    orientation = glm::mat3_cast(glm::normalize(glm::quat_cast(orientation)));
-    global_inverse_inertia = orientation * local_inverse_inertia * glm::transpose(orientation);
+    orientation() = glm::normalize(orientation());
+    storage->rotations_outdated[body] = true;
 }
 
 void Object::update_transform() {
-    transform = glm::translate(position) * glm::mat4(orientation);
-
+    storage->rotations_outdated[body] = true;
     update_bounds();
 }
 
 void Object::update(const Scene& scene, float step_size) {
-    if (inv_mass != 0.0f) {
-        linear_velocity += scene.gravity * step_size;
-    }
+    storage->integrate(body, scene.gravity, step_size);
+}
 
-    position += linear_velocity * step_size;
-    auto angle = glm::length(angular_velocity) * step_size;
-    if (angle != 0) {
-        auto axis = angular_velocity / angle;
-        orientation = glm::mat3(glm::rotate(angle, axis)) * orientation;
-        update_orientation();
-    }
-    update_transform();
+void Object::move(glm::vec3 translation, glm::vec3 rotation) {
+    storage->move(body, translation, rotation);
 }
 
 void Object::update_bounds() {
-    if (collider) {
-        if (collider->is_sphere_collider()) {
-            physics_bounds = collider->get_bounds().translate(position);
-        } else {
-            physics_bounds = collider->get_bounds().apply_transform(transform);
-        }
-    }
+    storage->update_bounds(body);
+}
 
-    if (main_shape) {
-        render_bounds = main_shape->get_bounds().apply_transform(transform);
-    } else if (shadow_shape) {
-        render_bounds = shadow_shape->get_bounds().apply_transform(transform);
-    }
+AABB Object::get_render_bounds() const {
+    if (main_shape) return main_shape->get_bounds().apply_transform(get_transform());
+    if (shadow_shape) return shadow_shape->get_bounds().apply_transform(get_transform());
+    return NAN_BOUNDS;
 }
\ No newline at end of file
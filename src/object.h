@@ -4,6 +4,7 @@
 #include <array>
 #include <string>
 #include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
 #include <memory>
 
 #include "util.h"
@@ -11,15 +12,17 @@
 #include "shape.h"
 #include "collider.h"
 #include "vec12.h"
+#include "body_storage.h"
 
-class MassMatrix;
 class Scene;
 
+// A handle to its entry in a BodyStorage, which holds the state the simulation works on
 class Object {
     public:
         // Explicit name
         explicit Object(std::string name, std::shared_ptr<Shape> main_shape, std::shared_ptr<Shape> shadow_shape, std::shared_ptr<Collider> collider) 
                 : name(name), main_shape(main_shape), shadow_shape(shadow_shape), collider(collider) {
+            storage->set_collider(body, collider.get());
             update_bounds();
         }
 
@@ -29,42 +32,70 @@ class Object {
             char buff[30];
             snprintf(buff, sizeof(buff), "object_%p", this);
             name = std::string(buff);
+            storage->set_collider(body, collider.get());
         }
 
+        // A detached copy, to be added to a scene
+        Object(const Object&);
+        void operator=(const Object&) = delete;
+
         ~Object();
 
         glm::vec3 colour = glm::vec3(1.0);
         std::shared_ptr<Texture> texture = {};
 
-        glm::vec3 linear_velocity = glm::vec3();
-        glm::vec3 angular_velocity = glm::vec3();
+        glm::vec3& linear_velocity() { return storage->linear_velocities[body]; }
+        glm::vec3& angular_velocity() { return storage->angular_velocities[body]; }
+        // Added to the velocities for the next update only, from the solver's position correction
+        glm::vec3& split_linear_velocity() { return storage->split_linear_velocities[body]; }
+        glm::vec3& split_angular_velocity() { return storage->split_angular_velocities[body]; }
+        glm::vec3& position() { return storage->positions[body]; }
+        glm::quat& orientation() { return storage->orientations[body]; } // Local space to global space
 
-        glm::vec3 position = glm::vec3();
-        glm::mat3 orientation = glm::mat3(1.0f); // Local space to global space
+        const glm::vec3& linear_velocity() const { return storage->linear_velocities[body]; }
+        const glm::vec3& angular_velocity() const { return storage->angular_velocities[body]; }
+        const glm::vec3& position() const { return storage->positions[body]; }
+        const glm::quat& orientation() const { return storage->orientations[body]; }
 
         float friction = 0.5f;
         float restitution = 0.3f;
+        // Continuous collision detection, stops the object where it first touches another collider within a step
+        // instead of letting it pass through. Only for sphere colliders, see Scene::sweep
+        bool ccd = false;
 
         bool reuse_shadow = false; // Only valid if light is non-moving
 
+        float& sleep_time() { return storage->sleep_times[body]; } // How long the object has been nearly still
+        // Set by the scene for the objects of sleeping islands, which aren't moved
+        bool is_sleeping() const { return storage->sleeping[body]; }
+        void set_sleeping(bool sleeping) { storage->sleeping[body] = sleeping; }
+
+        // Index of its entry in the storage it is in, the scene's solver bodies are in the same order
+        size_t get_body() const { return body; }
+
         std::string get_name() const {
             return name;
         }
 
         void load_transform() const;
+        // After changing orientation directly, normalises it
         void update_orientation();
+        // After changing position or orientation directly. Only the physics bounds are updated right away, the rotation
+        // matrix and global inertia are derived again once something asks for them (not thread safe for one object).
         void update_transform();
+        const glm::mat3& get_rotation() const { return storage->get_rotation(body); }
+        glm::mat4 get_transform() const { return storage->get_transform(body); }
 
         void update_bounds();
 
         void render_solid() const;
         void render_shadow(Light light) const;
         void cache_shadow(const Light& light);
-        void render_physics_bounds() const { physics_bounds.render(); }
-        void render_render_bounds() const { render_bounds.render(); }
+        void render_physics_bounds() const { get_physics_bounds().render(); }
+        void render_render_bounds() const { get_render_bounds().render(); }
 
-        AABB get_physics_bounds() const { return physics_bounds; }
-        AABB get_render_bounds() const { return render_bounds; }
+        AABB get_physics_bounds() const { return storage->physics_bounds[body]; }
+        AABB get_render_bounds() const;
 
         void set_mass(float); // Doesn't update inertia
         void set_density(float);
@@ -76,36 +107,34 @@ class Object {
         void set_infinite_inertia();
 
         void update(const Scene& scene, float step_size);
+        // Rotation is axis times angle, about the object's position
+        void move(glm::vec3 translation, glm::vec3 rotation);
+
+        // Infinite mass and inertia, constraints never change its velocity
+        bool is_static() const { return storage->is_static(body); }
 
-        glm::vec3 local_to_global(glm::vec3 p) const { return orientation * p + position; }
-        glm::vec3 global_to_local(glm::vec3 p) const { return glm::transpose(orientation) * (p - position); }
-        glm::vec3 local_to_global_vec(glm::vec3 v) const { return orientation * v; }
-        glm::vec3 global_to_local_vec(glm::vec3 v) const { return glm::transpose(orientation) * v; }
+        glm::vec3 local_to_global(glm::vec3 p) const { return get_rotation() * p + position(); }
+        glm::vec3 global_to_local(glm::vec3 p) const { return (p - position()) * get_rotation(); }
+        glm::vec3 local_to_global_vec(glm::vec3 v) const { return get_rotation() * v; }
+        glm::vec3 global_to_local_vec(glm::vec3 v) const { return v * get_rotation(); }
 
         std::shared_ptr<Shape> get_main_shape() { return main_shape; }
         std::shared_ptr<Shape> get_shadow_shape() { return shadow_shape; }
         std::shared_ptr<Collider> get_collider() { return collider; }
 
-        friend vec12 constexpr combined_velocity_vector(const Object& a, const Object& b);
-        friend void set_velocity(Object& a, Object& b, const vec12& v);
-        friend MassMatrix;
+        friend class XPBDSolver;
+        friend class BodyStorage;
     private:
-        std::string name;
+        BodyStorage* storage = &BodyStorage::detached();
+        size_t body = storage->add(this);
 
-        glm::mat4 transform = glm::mat4(1.0);
+        std::string name;
 
         std::shared_ptr<Shape> main_shape;
         std::shared_ptr<Shape> shadow_shape;
         std::shared_ptr<Collider> collider;
 
         float mass = 0.0f;
-        float inv_mass = 0.0f;
-
-        glm::mat3 local_inverse_inertia = glm::mat3(0.0);
-        glm::mat3 global_inverse_inertia = glm::mat3(0.0);
-
-        AABB physics_bounds = NAN_BOUNDS;
-        AABB render_bounds = NAN_BOUNDS;
 
         GLuint shadow_displaylist = 0;
 };
\ No newline at end of file
@@ -1,5 +1,14 @@
 #include "scene.h"
 
+#include <unordered_set>
+#include <algorithm>
+#include <atomic>
+
+#include "thread_pool.h"
+
+#include <nlohmann/json.hpp>
+using json = nlohmann::json;
+
 // TODO Remove
 #include <iostream>
 #include <glm/gtx/string_cast.hpp>
@@ -27,45 +36,74 @@ void Scene::update(float step_size) {
     for (size_t i = 0; i<substeps; i++) {
         update();
     }
+
+    bvh_frame_stats = BVHQueryCounters::the().collect();
 }
 
 void Scene::update_single(float step_size) {
     if (controller) controller->update();
 
+    assert(body_storage.size() == objects.size()); // Objects have to be added with add_object
+
     contacts.clear();
     //std::cout << step_size << std::endl;
-    for (size_t i = 0; i<objects.size(); i++) {
-        auto& obj_a = *objects[i];
-        if (!obj_a.get_collider()) continue;
+    auto& bodies = body_storage;
+    for (size_t i = 0; i<bodies.size(); i++) {
+        if (!bodies.has_collider[i]) continue;
 
         for (size_t j = 0; j<i; j++) {
-            auto& obj_b = *objects[j];
+            if (!bodies.has_collider[j]) continue;
 
-            if (!obj_b.get_collider()) continue;
-            if (!obj_a.get_physics_bounds().intersect(obj_b.get_physics_bounds())) continue;
-            evaluate_contact(obj_a, obj_b);
+            // How far the objects can move towards each other within the step, their rotation isn't taken into account
+            float margin = speculative_contacts ? glm::length(bodies.linear_velocities[i] - bodies.linear_velocities[j]) * step_size : 0.0f;
+            if (!bodies.physics_bounds[i].expand(margin).intersect(bodies.physics_bounds[j])) continue;
+            evaluate_contact(*bodies.objects[i], *bodies.objects[j], margin);
         }
     }
-    //std::cout << std::endl;
-    for (size_t i = 0; i<solver_steps; i++) {
-        for (auto& constraint : constraints) {
-            constraint->apply(*this, step_size);
-        }
-        for (auto& constraint : contacts) {
-            constraint.apply(*this, step_size);
+
+    if (backend == Backend::XPBD) { // No islands, and a single iteration per substep
+        xpbd.step(*this, contacts, step_size);
+        island_stats = {};
+        solver_stats = {};
+        solver_stats.iterations = solver_stats.total_iterations = xpbd_substeps;
+        tick += step_size;
+        return;
+    }
+
+    solve_constraints(step_size);
+
+    // Only pairs that are touching now are kept, so removed objects drop out after a step.
+    // Sleeping pairs weren't solved, they keep what they had when they fell asleep.
+    auto previous_cache = std::move(contact_cache);
+    contact_cache.clear();
+    for (auto& contact : contacts) {
+        auto key = contact.get_key();
+        auto it = previous_cache.find(key);
+        if ((contact.get_object_a().is_sleeping() || contact.get_object_b().is_sleeping()) && it != previous_cache.end()) {
+            contact_cache[key] = it->second;
+        } else {
+            contact_cache[key] = contact.save_cache();
         }
-        //std::cout << std::endl;
-        //for (auto& constraint : contacts) {
-        //    constraint.dump();
-        //}
     }
-    // std::cout << std::endl;
-    // for (auto& constraint : contacts) {
-    //     constraint.dump();
-    // }
     
-    for (auto object : objects) {
-        object->update(*this, step_size);
+    std::vector<std::pair<Object*, glm::vec3>> swept; // Object::ccd ones and where they started
+    for (auto& object : objects) {
+        if (object->ccd && !object->is_sleeping()) swept.emplace_back(object.get(), object->position());
+    }
+
+    // Every body only writes to itself
+    ThreadPool::the().parallel_for(bodies.size(), 256, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i<end; i++) {
+            if (bodies.sleeping[i]) continue;
+            if (solver_substeps > 1 && !bodies.is_static(i)) { // The solver already moved it, gravity included
+                bodies.move(i, solver_bodies[i].delta_position, solver_bodies[i].delta_rotation);
+            } else {
+                bodies.integrate(i, gravity, step_size);
+            }
+        }
+    });
+    for (auto [object, start] : swept) {
+        sweep(*object, start, step_size);
     }
 
     tick += step_size;
@@ -77,7 +115,7 @@ void Scene::update_single(float step_size) {
 //    }
 //}
 
-void Scene::evaluate_contact(Object& object_a, Object& object_b) {
+void Scene::evaluate_contact(Object& object_a, Object& object_b, float margin) {
     const auto& collider_a = *object_a.get_collider();
     const auto& collider_b = *object_b.get_collider();
     if (collider_a.is_shape_collider()) {
@@ -86,7 +124,8 @@ void Scene::evaluate_contact(Object& object_a, Object& object_b) {
                 object_a, 
                 object_b, 
                 reinterpret_cast<const ShapeCollider&>(collider_a), 
-                reinterpret_cast<const SphereCollider&>(collider_b)
+                reinterpret_cast<const SphereCollider&>(collider_b),
+                margin
             );
         }
     } else if (collider_a.is_sphere_collider()) {
@@ -95,26 +134,28 @@ void Scene::evaluate_contact(Object& object_a, Object& object_b) {
                 object_a, 
                 object_b, 
                 reinterpret_cast<const SphereCollider&>(collider_a), 
-                reinterpret_cast<const SphereCollider&>(collider_b)
+                reinterpret_cast<const SphereCollider&>(collider_b),
+                margin
             );
         } else if (collider_b.is_shape_collider()) {
             evaluate_contact(
                 object_b, 
                 object_a, 
                 reinterpret_cast<const ShapeCollider&>(collider_b),
-                reinterpret_cast<const SphereCollider&>(collider_a)
+                reinterpret_cast<const SphereCollider&>(collider_a),
+                margin
             );
         }
     }
 }
 
-void Scene::evaluate_contact(Object& object_a, Object& object_b, const SphereCollider& collider_a, const SphereCollider& collider_b) {
-    auto vec = object_b.position - object_a.position;
+void Scene::evaluate_contact(Object& object_a, Object& object_b, const SphereCollider& collider_a, const SphereCollider& collider_b, float margin) {
+    auto vec = object_b.position() - object_a.position();
     float dist = glm::length(vec);
     if (dist == 0.0f) return;
 
     float penetration = collider_a.get_radius() + collider_b.get_radius() - dist;
-    if (penetration < 0.0f) return;
+    if (penetration < -margin) return;
 
     ContactConstraint constraint(object_a, object_b);
 
@@ -153,7 +194,7 @@ void Scene::evaluate_contact(Object& object_a, Object& object_b, const SphereCol
 //         }
 //     }
 
-//     if (dist > collider_b.get_radius()) return;
+//     if (dist > radius) return;
 
 //     glm::vec3 vec = test_point - closest;
 //     vec /= dist;
@@ -173,15 +214,28 @@ void Scene::evaluate_contact(Object& object_a, Object& object_b, const SphereCol
 //     contacts.push_back(constraint);
 // }
 
-void Scene::evaluate_contact(Object& object_a, Object& object_b, const ShapeCollider& collider_a, const SphereCollider& collider_b) {
+void Scene::evaluate_contact(Object& object_a, Object& object_b, const ShapeCollider& collider_a, const SphereCollider& collider_b, float margin) {
     auto& shape = collider_a.get_shape();
 
-    auto test_point = object_a.global_to_local(object_b.position);
-
-    glm::vec3 closest = glm::vec3();
-    float dist = std::numeric_limits<float>::infinity();
+    auto test_point = object_a.global_to_local(object_b.position());
+    float radius = collider_b.get_radius() + margin;
 
-    for (auto& face : shape.get_faces()) {
+    // Only faces within the radius can produce a contact, so large meshes only look at what the BVH returns
+    const bool use_bvh = collider_a.is_bvh_shape_collider();
+    std::vector<const Face*> candidates;
+    if (use_bvh) {
+        auto query = AABB(test_point, test_point).expand(radius);
+        candidates = reinterpret_cast<const BVHShapeCollider&>(collider_a).intersect(query);
+    }
+    const size_t candidate_count = use_bvh ? candidates.size() : shape.get_faces().size();
+    auto get_candidate = [&](size_t i) -> const Face& {
+        return use_bvh ? *candidates[i] : shape.get_faces()[i];
+    };
+
+    // Closest point of every face within the radius, with its distance
+    std::vector<std::pair<float, glm::vec3>> points;
+    for (size_t i = 0; i<candidate_count; i++) {
+        auto& face = get_candidate(i);
         std::array<glm::vec3, 3> face_vertices = {
             shape.get_vertices()[face[0].vertex], 
             shape.get_vertices()[face[1].vertex], 
@@ -199,58 +253,31 @@ void Scene::evaluate_contact(Object& object_a, Object& object_b, const ShapeColl
             face_vertices[2]
         );
 
-        glm::vec3 vec = test_point - new_closest;
-        float new_dist = glm::length(vec);
-        
-        if (new_dist < dist) {
-            dist = new_dist;
-            closest = new_closest;
-        }
+        float new_dist = glm::length(test_point - new_closest);
+        if (new_dist <= radius) points.emplace_back(new_dist, new_closest);
     }
+    if (points.empty()) return;
 
-    if (dist > collider_b.get_radius()) return;
-
-    glm::vec3 closest_vec = test_point - closest;
-    closest_vec /= dist;
+    // Closest first, then every point that is far enough from and at an angle to those already taken.
+    // Faces that share the point (e.g. near an edge) would just add the same contact again.
+    std::sort(points.begin(), points.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    std::vector<std::pair<glm::vec3, glm::vec3>> taken; // Point and direction to the sphere, local space
 
-    glm::vec3 next_closest = glm::vec3();
-    float next_dist = std::numeric_limits<float>::infinity();
-    for (auto& face : shape.get_faces()) {
-        std::array<glm::vec3, 3> face_vertices = {
-            shape.get_vertices()[face[0].vertex], 
-            shape.get_vertices()[face[1].vertex], 
-            shape.get_vertices()[face[2].vertex],
-        };
-
-        auto normal = glm::cross(face_vertices[1] - face_vertices[0], face_vertices[2] - face_vertices[0]);
-
-        if (glm::dot(normal, test_point - face_vertices[0]) <= 0) continue;
-
-        glm::vec3 new_closest = project_point_to_triangle(
-            test_point, 
-            face_vertices[0],
-            face_vertices[1],
-            face_vertices[2]
-        );
-
-        if (glm::length(new_closest - closest) < 0.1) continue; // Points are too close
-
-        glm::vec3 vec = test_point - new_closest;
-        float new_dist = glm::length(vec);
+    ContactConstraint constraint(object_a, object_b);
+    for (auto& [dist, closest] : points) {
+        glm::vec3 vec = test_point - closest;
 
-        if (glm::dot(closest_vec, vec) > new_dist * 0.98) continue; // Vectors are within 11 degrees
-        
-        if (new_dist < next_dist) {
-            next_dist = new_dist;
-            next_closest = new_closest;
+        bool distinct = true;
+        for (auto& [other, other_vec] : taken) {
+            if (glm::length(closest - other) < 0.1) distinct = false;     // Points are too close
+            if (glm::dot(other_vec, vec) > dist * 0.98) distinct = false; // Vectors are within 11 degrees
         }
-    }
-
-    closest_vec = object_a.local_to_global_vec(closest_vec);
+        if (!distinct) continue;
 
-    ContactConstraint constraint(object_a, object_b);
+        vec /= dist;
+        taken.emplace_back(closest, vec);
 
-    {
+        auto closest_vec = object_a.local_to_global_vec(vec);
         auto a = object_a.local_to_global_vec(closest);
         auto b = closest_vec * (-collider_b.get_radius());
 
@@ -260,25 +287,7 @@ void Scene::evaluate_contact(Object& object_a, Object& object_b, const ShapeColl
             closest_vec
         );
     }
-    
-
-
-    if (next_dist <= collider_b.get_radius()) {
-        auto next_closest_vec = test_point - next_closest;
-        next_closest_vec /= next_dist;
 
-        next_closest_vec = object_a.local_to_global_vec(next_closest_vec);
-
-        auto a = object_a.local_to_global_vec(next_closest);
-        auto b = next_closest_vec * (-collider_b.get_radius());
-
-        constraint.add_contact(
-            a,
-            b,
-            next_closest_vec
-        );
-    }
-    
     contacts.push_back(constraint);
 }
 
@@ -422,7 +431,7 @@ void Scene::render_skybox() const {
 }
 
 void Scene::ambient_pass(glm::vec3 colour) const {
-    for (auto object : objects) {
+    for (auto& object : objects) {
         auto litColour = object->colour * colour;
         glColor(litColour);
         object->render_solid();
@@ -446,13 +455,13 @@ void Scene::light_pass(const Light& light) const {
     glCullFace(GL_FRONT);
     glStencilOp(GL_KEEP, GL_INCR, GL_KEEP);
 
-    for (auto object : objects) {
+    for (auto& object : objects) {
         object->cache_shadow(light);
     }
 
     GLuint displaylist = glGenLists(1);
     glNewList(displaylist, GL_COMPILE_AND_EXECUTE);
-    for (auto object : objects) {
+    for (auto& object : objects) {
         object->render_shadow(light);
     }
     glEndList();
@@ -489,7 +498,7 @@ void Scene::light_pass(const Light& light) const {
     glEnable(GL_BLEND);
     glBlendFunc(GL_ONE, GL_ONE);
 
-    for (auto object : objects) {
+    for (auto& object : objects) {
         glColor(object->colour);
         object->render_solid();
     }
@@ -503,6 +512,436 @@ void Scene::light_pass(const Light& light) const {
     glDepthFunc(GL_LEQUAL);
 }
 
+void Scene::build_islands(float step_size) {
+    islands.clear();
+    island_stats = {};
+
+    // Static objects never carry velocity from one constraint to another, so they don't join islands
+    std::unordered_map<const Object*, uint32_t> indices;
+    std::vector<Object*> bodies;
+    for (auto& object : objects) {
+        if (object->is_static()) continue;
+        indices[object.get()] = (uint32_t)bodies.size();
+        bodies.push_back(object.get());
+    }
+
+    std::vector<uint32_t> parents(bodies.size());
+    for (uint32_t i = 0; i<parents.size(); i++) {
+        parents[i] = i;
+    }
+    auto find = [&](uint32_t i) {
+        while (parents[i] != i) {
+            parents[i] = parents[parents[i]];
+            i = parents[i];
+        }
+        return i;
+    };
+    // Index of a dynamic object of the constraint, or -1 if both are static
+    auto body_of = [&](const Constraint& constraint) {
+        auto it = indices.find(&constraint.get_object_a());
+        if (it == indices.end()) it = indices.find(&constraint.get_object_b());
+        return it == indices.end() ? (uint32_t)-1 : it->second;
+    };
+    auto unite = [&](const Constraint& constraint) {
+        auto a = indices.find(&constraint.get_object_a());
+        auto b = indices.find(&constraint.get_object_b());
+        if (a == indices.end() || b == indices.end()) return;
+        parents[find(a->second)] = find(b->second);
+    };
+    for (auto& joint : ball_socket_joints) {
+        unite(joint);
+    }
+    for (auto& joint : hinge_joints) {
+        unite(joint);
+    }
+    for (auto& contact : contacts) {
+        unite(contact);
+    }
+
+    // Joints that close a loop, counting all static objects as one (e.g. the second hinge of a seat hanging from two chains).
+    // Those start cold, the joints around a loop can fight each other over the impulses they carry into the next step.
+    std::vector<uint32_t> loop_parents(bodies.size() + 1); // The last one is the static objects
+    for (uint32_t i = 0; i<loop_parents.size(); i++) {
+        loop_parents[i] = i;
+    }
+    auto loop_find = [&](uint32_t i) {
+        while (loop_parents[i] != i) {
+            loop_parents[i] = loop_parents[loop_parents[i]];
+            i = loop_parents[i];
+        }
+        return i;
+    };
+    auto close_loop = [&](Constraint& joint) {
+        auto a = indices.find(&joint.get_object_a());
+        auto b = indices.find(&joint.get_object_b());
+        auto root_a = loop_find(a == indices.end() ? (uint32_t)bodies.size() : a->second);
+        auto root_b = loop_find(b == indices.end() ? (uint32_t)bodies.size() : b->second);
+        joint.closes_loop = root_a == root_b;
+        loop_parents[root_a] = root_b;
+    };
+    for (auto& joint : ball_socket_joints) {
+        close_loop(joint);
+    }
+    for (auto& joint : hinge_joints) {
+        close_loop(joint);
+    }
+
+    std::vector<uint32_t> island_indices(bodies.size(), (uint32_t)-1); // Per root
+    for (uint32_t i = 0; i<bodies.size(); i++) {
+        auto& island_index = island_indices[find(i)];
+        if (island_index == (uint32_t)-1) {
+            island_index = (uint32_t)islands.size();
+            islands.emplace_back();
+        }
+        islands[island_index].objects.push_back(bodies[i]);
+    }
+    // Keeps the original order within each island
+    for (auto& joint : ball_socket_joints) {
+        auto body = body_of(joint);
+        if (body != (uint32_t)-1) islands[island_indices[find(body)]].ball_socket_joints.push_back(&joint);
+    }
+    for (auto& joint : hinge_joints) {
+        auto body = body_of(joint);
+        if (body != (uint32_t)-1) islands[island_indices[find(body)]].hinge_joints.push_back(&joint);
+    }
+    for (auto& contact : contacts) {
+        auto body = body_of(contact);
+        if (body != (uint32_t)-1) islands[island_indices[find(body)]].contacts.push_back(&contact);
+    }
+
+    // An island only sleeps once all of its objects have been nearly still for long enough.
+    // Anything awake that touches it joins the island and wakes it up.
+    for (auto body : bodies) {
+        bool still = glm::length(body->linear_velocity()) < sleep_linear_velocity && glm::length(body->angular_velocity()) < sleep_angular_velocity;
+        body->sleep_time() = still ? body->sleep_time() + step_size : 0.0f;
+    }
+    for (auto& island : islands) {
+        island.sleeping = allow_sleeping;
+        for (auto object : island.objects) {
+            if (object->sleep_time() < time_to_sleep) island.sleeping = false;
+        }
+        for (auto object : island.objects) {
+            object->set_sleeping(island.sleeping);
+            if (island.sleeping) {
+                object->linear_velocity() = glm::vec3(0.0f);
+                object->angular_velocity() = glm::vec3(0.0f);
+            }
+        }
+
+        island_stats.islands++;
+        island_stats.objects += island.objects.size();
+        island_stats.largest = std::max(island_stats.largest, island.objects.size());
+        if (island.sleeping) island_stats.sleeping++;
+    }
+}
+
+void Scene::colour_constraints(const Island& island) {
+    solver_batches.clear();
+    solver_overflow.clear();
+
+    // Greedy colouring, each bit is a batch that a constraint on the object is already in.
+    // Static objects are never written to, so any number of constraints in a batch can share one.
+    std::unordered_map<const Object*, uint64_t> used_batches;
+    auto add = [&](Constraint& constraint) -> SolverBatch* {
+        auto& a = constraint.get_object_a();
+        auto& b = constraint.get_object_b();
+
+        uint64_t used = 0;
+        if (!a.is_static()) used |= used_batches[&a];
+        if (!b.is_static()) used |= used_batches[&b];
+
+        if (used == ~(uint64_t)0) {
+            solver_overflow.push_back(&constraint);
+            return nullptr;
+        }
+
+        size_t batch = 0;
+        while (used & ((uint64_t)1 << batch)) batch++;
+        if (batch >= solver_batches.size()) solver_batches.resize(batch + 1);
+
+        if (!a.is_static()) used_batches[&a] |= (uint64_t)1 << batch;
+        if (!b.is_static()) used_batches[&b] |= (uint64_t)1 << batch;
+        return &solver_batches[batch];
+    };
+
+    for (auto joint : island.iterative_ball_socket_joints) {
+        auto batch = add(*joint);
+        if (batch) batch->ball_socket_joints.push_back(joint);
+    }
+    for (auto joint : island.iterative_hinge_joints) {
+        auto batch = add(*joint);
+        if (batch) batch->hinge_joints.push_back(joint);
+    }
+    for (auto contact : island.contacts) {
+        auto batch = add(*contact);
+        if (!batch) continue;
+
+        if (wide_contacts) {
+            batch->contacts.add(*contact);
+        } else {
+            batch->narrow_contacts.push_back(contact);
+        }
+    }
+}
+
+// Each type in its own loop, so the calls are direct
+float Scene::SolverBatch::solve(size_t i) {
+    if (i < ball_socket_joints.size()) return ball_socket_joints[i]->solve();
+    i -= ball_socket_joints.size();
+    if (i < hinge_joints.size()) return hinge_joints[i]->solve();
+    i -= hinge_joints.size();
+    if (i < narrow_contacts.size()) return narrow_contacts[i]->solve();
+    return contacts.solve(i - narrow_contacts.size());
+}
+
+// For the residual of a large island, which the solver threads all contribute to
+static void atomic_max(std::atomic<float>& value, float x) {
+    float current = value.load();
+    while (x > current && !value.compare_exchange_weak(current, x)) {}
+}
+
+void Scene::solve_constraints(float step_size) {
+    build_islands(step_size);
+
+    solver_bodies.resize(body_storage.size());
+    for (size_t i = 0; i<body_storage.size(); i++) {
+        solver_bodies[i].load(body_storage, i);
+    }
+
+    // Small islands are independent tasks that are each solved on one thread,
+    // large ones are solved one after another with all threads working on them
+    std::vector<Island*> small_islands;
+    std::vector<Island*> large_islands;
+    for (auto& island : islands) {
+        if (island.sleeping) continue;
+        (island.joint_count() + island.contacts.size() >= PARALLEL_SOLVE_THRESHOLD ? large_islands : small_islands).push_back(&island);
+    }
+
+    auto& pool = ThreadPool::the();
+    pool.parallel_for(small_islands.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i<end; i++) solve_island(*small_islands[i], step_size);
+    });
+
+    float substep = step_size / solver_substeps;
+    for (auto island : large_islands) {
+        // Only touches the constraints themselves, so the order doesn't matter
+        pool.parallel_for(island->ball_socket_joints.size(), 64, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i<end; i++) {
+                island->ball_socket_joints[i]->bind(solver_bodies);
+                island->ball_socket_joints[i]->prepare(*this, substep);
+            }
+        });
+        pool.parallel_for(island->hinge_joints.size(), 64, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i<end; i++) {
+                island->hinge_joints[i]->bind(solver_bodies);
+                island->hinge_joints[i]->prepare(*this, substep);
+            }
+        });
+        pool.parallel_for(island->contacts.size(), 64, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i<end; i++) {
+                island->contacts[i]->bind(solver_bodies);
+                island->contacts[i]->prepare(*this, substep);
+            }
+        });
+
+        warm_start_island(*island);
+        split_joints(*island);
+
+        colour_constraints(*island);
+        island->iterations = 0;
+        for (size_t s = 0; s<solver_substeps; s++) {
+            if (s > 0) { // The wide solvers work on copies of the contacts' impulses and biases
+                for (auto& batch : solver_batches) batch.contacts.store_impulses();
+                start_substep(*island, substep, false);
+                for (auto& batch : solver_batches) batch.contacts.reload();
+            } else if (solver_substeps > 1) {
+                start_substep(*island, substep, true);
+            }
+
+            size_t iterations = 0;
+            do {
+                std::atomic<float> residual(0.0f);
+
+                // Trees share no bodies with each other, but they can with the contacts in the batches
+                pool.parallel_for(island->joint_trees.size(), 1, [&](size_t begin, size_t end) {
+                    float local = 0.0f;
+                    for (size_t j = begin; j<end; j++) local = std::max(local, island->joint_trees[j].solve());
+                    atomic_max(residual, local);
+                });
+                for (auto& batch : solver_batches) { // parallel_for only returns once the whole batch is done
+                    pool.parallel_for(batch.size(), 16, [&](size_t begin, size_t end) {
+                        float local = 0.0f;
+                        for (size_t j = begin; j<end; j++) {
+                            local = std::max(local, batch.solve(j));
+                        }
+                        atomic_max(residual, local);
+                    });
+                }
+                float local = 0.0f;
+                for (auto constraint : solver_overflow) {
+                    local = std::max(local, constraint->solve());
+                }
+                atomic_max(residual, local);
+
+                iterations++;
+                island->residual = residual;
+            } while (iterations < solver_steps && island->residual >= solver_tolerance);
+            island->iterations += iterations;
+
+            if (solver_substeps > 1) {
+                pool.parallel_for(island->objects.size(), 256, [&](size_t begin, size_t end) {
+                    for (size_t i = begin; i<end; i++) solver_bodies[island->objects[i]->get_body()].integrate(substep);
+                });
+            }
+        }
+        for (auto& batch : solver_batches) {
+            batch.contacts.store_impulses();
+        }
+    }
+
+    for (size_t i = 0; i<body_storage.size(); i++) {
+        if (!solver_bodies[i].is_static) solver_bodies[i].store(body_storage, i);
+    }
+
+    solver_stats = {};
+    for (auto islands : { &small_islands, &large_islands }) {
+        for (auto island : *islands) {
+            solver_stats.iterations = std::max(solver_stats.iterations, island->iterations);
+            solver_stats.total_iterations += island->iterations;
+            solver_stats.residual = std::max(solver_stats.residual, island->residual);
+        }
+    }
+}
+
+void Scene::solve_island(Island& island, float step_size) {
+    float substep = step_size / solver_substeps;
+    island.for_each_joint([&](auto& joint) {
+        joint.bind(solver_bodies);
+        joint.prepare(*this, substep);
+    });
+    for (auto contact : island.contacts) {
+        contact->bind(solver_bodies);
+        contact->prepare(*this, substep);
+    }
+
+    warm_start_island(island);
+    split_joints(island);
+
+    //std::cout << std::endl;
+    island.iterations = 0;
+    for (size_t s = 0; s<solver_substeps; s++) {
+        if (solver_substeps > 1) start_substep(island, substep, s == 0);
+
+        size_t iterations = 0;
+        do {
+            float residual = 0.0f;
+            for (auto& tree : island.joint_trees) {
+                residual = std::max(residual, tree.solve());
+            }
+            for (auto joint : island.iterative_ball_socket_joints) {
+                residual = std::max(residual, joint->solve());
+            }
+            for (auto joint : island.iterative_hinge_joints) {
+                residual = std::max(residual, joint->solve());
+            }
+            for (auto contact : island.contacts) {
+                residual = std::max(residual, contact->solve());
+            }
+            //std::cout << std::endl;
+            //for (auto& constraint : contacts) {
+            //    constraint.dump();
+            //}
+
+            iterations++;
+            island.residual = residual;
+        } while (iterations < solver_steps && island.residual >= solver_tolerance);
+        island.iterations += iterations;
+
+        if (solver_substeps > 1) {
+            for (auto object : island.objects) solver_bodies[object->get_body()].integrate(substep);
+        }
+    }
+    // std::cout << std::endl;
+    // for (auto& constraint : contacts) {
+    //     constraint.dump();
+    // }
+}
+
+// Gravity is applied by the solver when substepping. Every substep after the first one starts from the
+// impulses the previous one ended with, like a step starts from those of the previous step.
+void Scene::start_substep(Island& island, float substep, bool first) {
+    if (!first) {
+        island.for_each_joint([&](auto& joint) {
+            joint.advance(substep);
+        });
+        for (auto contact : island.contacts) {
+            contact->advance(substep);
+        }
+        for (auto& tree : island.joint_trees) {
+            tree.load_rows();
+        }
+    }
+
+    for (auto object : island.objects) {
+        auto& body = solver_bodies[object->get_body()];
+        if (body.inv_mass != 0.0f) body.linear_velocity += gravity * substep;
+    }
+
+    if (!first) {
+        island.for_each_joint([&](auto& joint) {
+            joint.warm_start(1.0f);
+        });
+        for (auto contact : island.contacts) {
+            contact->warm_start();
+        }
+    }
+}
+
+void Scene::split_joints(Island& island) {
+    if (direct_joints) {
+        // All ball and socket joints, then all hinges
+        std::vector<Constraint*> joints;
+        std::vector<uint8_t> iterative;
+        island.for_each_joint([&](auto& joint) { joints.push_back(&joint); });
+        JointTree::split(joints, island.joint_trees, iterative);
+
+        size_t i = 0;
+        for (auto joint : island.ball_socket_joints) {
+            if (iterative[i++]) island.iterative_ball_socket_joints.push_back(joint);
+        }
+        for (auto joint : island.hinge_joints) {
+            if (iterative[i++]) island.iterative_hinge_joints.push_back(joint);
+        }
+    } else {
+        island.iterative_ball_socket_joints = island.ball_socket_joints;
+        island.iterative_hinge_joints = island.hinge_joints;
+    }
+
+    for (auto& tree : island.joint_trees) {
+        tree.factor(split_impulse);
+    }
+}
+
+void Scene::warm_start_island(Island& island) {
+    if (warm_starting) {
+        island.for_each_joint([&](auto& joint) {
+            if (joint.closes_loop) {
+                joint.reset_impulses();
+            } else {
+                joint.warm_start(warm_start_factor);
+            }
+        });
+        for (auto contact : island.contacts) {
+            auto it = contact_cache.find(contact->get_key());
+            if (it != contact_cache.end()) contact->warm_start(it->second, warm_start_factor);
+        }
+    } else {
+        island.for_each_joint([&](auto& joint) {
+            joint.reset_impulses();
+        });
+    }
+}
+
 void Scene::render() const {
     render_skybox();
     ambient_pass(ambient_colour);
@@ -531,7 +970,7 @@ void Scene::render() const {
         glDisable(GL_BLEND);
         glDepthFunc(GL_ALWAYS);
         glColor(0.3, 0.3, 0.3);
-        for (auto object : objects) {
+        for (auto& object : objects) {
             object->render_physics_bounds();
         }
 
@@ -543,11 +982,11 @@ void Scene::render() const {
         glDepthFunc(GL_LEQUAL);
 
         glColor(1, 1, 1);
-        for (auto object : objects) {
+        for (auto& object : objects) {
             object->render_physics_bounds();
         }
 
-        for (auto object : objects) {
+        for (auto& object : objects) {
             auto collider = object->get_collider();
             if (collider) {
                 if (collider->is_shape_collider()) {
@@ -555,7 +994,7 @@ void Scene::render() const {
                     if (shape_collider.is_bvh_shape_collider()) {
                         glPushMatrix();
                         object->load_transform();
-                        reinterpret_cast<BVHShapeCollider&>(shape_collider).get_bvh_tree().debug_draw();
+                        reinterpret_cast<BVHShapeCollider&>(shape_collider).debug_draw_bvh();
                         glPopMatrix();
                     }
                 }
@@ -567,7 +1006,7 @@ void Scene::render() const {
 }
 
 std::shared_ptr<Object> Scene::get_object(std::string name) {
-    for (auto object : objects) {
+    for (auto& object : objects) {
         if (object->get_name() == name) {
             return object;
         }
@@ -575,10 +1014,29 @@ std::shared_ptr<Object> Scene::get_object(std::string name) {
     return {};
 }
 
+void Scene::add_object(std::shared_ptr<Object> object) {
+    body_storage.take(*object);
+    objects.push_back(std::move(object));
+}
+
+void Scene::remove_objects(const std::function<bool(const Object&)>& predicate) {
+    auto end = std::stable_partition(objects.begin(), objects.end(), [&](const std::shared_ptr<Object>& object) {
+        return !predicate(*object);
+    });
+    // Those that are still used elsewhere live on outside of the scene
+    for (auto it = end; it != objects.end(); it++) {
+        BodyStorage::detached().take(**it);
+    }
+    objects.erase(end, objects.end());
+}
+
 void Scene::clear() {
     objects.clear();
-    constraints.clear();
+    body_storage.release_all();
+    ball_socket_joints.clear();
+    hinge_joints.clear();
     contacts.clear();
+    contact_cache.clear();
     lights.clear();
 }
 
@@ -589,4 +1047,178 @@ bool Scene::is_empty(AABB bounds) const {
         }
     }
     return true;
-}
\ No newline at end of file
+}
+
+void Scene::sweep(Object& object, glm::vec3 start, float step_size) {
+    auto collider = object.get_collider();
+    if (!collider || !collider->is_sphere_collider()) return;
+
+    float radius = reinterpret_cast<const SphereCollider&>(*collider).get_radius();
+    glm::vec3 motion = object.position() - start;
+
+    // Lowers t (a fraction of motion) to when the sphere first touches another collider on its way from start,
+    // and sets what it touches with the normal of the contact
+    auto find_impact = [&](float& t, Object*& hit_object, glm::vec3& normal) {
+        auto bounds = AABB(glm::min(start, start + motion), glm::max(start, start + motion)).expand(radius);
+        for (auto& other : objects) {
+            if (other.get() == &object || !other->get_collider()) continue;
+            if (!other->get_physics_bounds().intersect(bounds)) continue;
+
+            bool hit = false;
+            auto& other_collider = *other->get_collider();
+            if (other_collider.is_sphere_collider()) {
+                float other_radius = reinterpret_cast<const SphereCollider&>(other_collider).get_radius();
+                hit = sweep_sphere_point(start, motion, radius + other_radius - CCD_DEPTH, other->position(), t, normal);
+            } else if (other_collider.is_shape_collider()) {
+                // In the shape's space, the faces along the way come from its BVH if it has one
+                auto& shape_collider = reinterpret_cast<const ShapeCollider&>(other_collider);
+                auto& shape = shape_collider.get_shape();
+                auto& vertices = shape.get_vertices();
+                auto origin = other->global_to_local(start);
+                auto local_motion = other->global_to_local_vec(motion);
+
+                glm::vec3 local_normal;
+                auto sweep_face = [&](const Face& face) {
+                    hit |= sweep_sphere_triangle(origin, local_motion, radius - CCD_DEPTH, vertices[face[0].vertex], vertices[face[1].vertex], vertices[face[2].vertex], t, local_normal);
+                };
+                if (shape_collider.is_bvh_shape_collider()) {
+                    auto query = AABB(glm::min(origin, origin + local_motion), glm::max(origin, origin + local_motion)).expand(radius);
+                    for (auto face : reinterpret_cast<const BVHShapeCollider&>(shape_collider).intersect(query)) sweep_face(*face);
+                } else {
+                    for (auto& face : shape.get_faces()) sweep_face(face);
+                }
+                if (hit) normal = other->local_to_global_vec(local_normal);
+            }
+            if (hit) hit_object = other.get();
+        }
+    };
+
+    auto& bodies = body_storage;
+    float remaining_time = step_size;
+    for (size_t impacts = 0; motion != glm::vec3(0.0f); impacts++) {
+        float t = 1.0f;
+        Object* other = nullptr;
+        glm::vec3 normal;
+        find_impact(t, other, normal);
+        if (t == 1.0f) {
+            if (impacts == 0) return; // Nothing in the way
+            start += motion;
+            break;
+        }
+
+        start += motion * t;
+        if (impacts + 1 == CCD_MAX_IMPACTS) break; // Stays at the last impact, the next step's contacts take over
+
+        // Resolved like a contact without restitution or friction, the two stop moving into each other and the sphere
+        // slides along for the rest of the step. The other object's new velocity only moves it in the next step.
+        size_t a = object.get_body(), b = other->get_body();
+        auto arm = start - normal * radius - other->position();
+        auto& inverse_inertia = bodies.get_global_inverse_inertia(b);
+        float approach = glm::dot(bodies.linear_velocities[a] - bodies.linear_velocities[b] - glm::cross(bodies.angular_velocities[b], arm), normal);
+        float inv_mass = bodies.inv_masses[a] + bodies.inv_masses[b] + glm::dot(glm::cross(inverse_inertia * glm::cross(arm, normal), arm), normal);
+        if (approach < 0.0f && inv_mass > 0.0f) {
+            float impulse = -approach / inv_mass;
+            bodies.linear_velocities[a] += normal * (impulse * bodies.inv_masses[a]);
+            bodies.linear_velocities[b] -= normal * (impulse * bodies.inv_masses[b]);
+            bodies.angular_velocities[b] -= inverse_inertia * glm::cross(arm, normal) * impulse;
+        }
+
+        remaining_time *= 1.0f - t;
+        motion = bodies.linear_velocities[a] * remaining_time;
+    }
+
+    // Rotation doesn't change a sphere's collider, so the object keeps all of it
+    object.position() = start;
+    object.update_transform();
+}
+
+std::optional<ObjectRayHit> Scene::ray_cast(glm::vec3 origin, glm::vec3 direction, float max_distance) const {
+    const glm::vec3 inv_direction = 1.0f / direction;
+
+    std::optional<ObjectRayHit> result;
+    for (auto& object : objects) {
+        auto collider = object->get_collider();
+        if (!collider) continue;
+
+        float entry;
+        if (!object->get_physics_bounds().intersect_ray(origin, inv_direction, max_distance, entry)) continue;
+
+        auto hit = collider->ray_cast(object->global_to_local(origin), object->global_to_local_vec(direction), max_distance);
+        if (!hit) continue;
+
+        max_distance = hit->distance;
+        result = ObjectRayHit{
+            object,
+            hit->distance,
+            origin + direction * hit->distance,
+            object->local_to_global_vec(hit->normal),
+            hit->face,
+            hit->barycentric,
+        };
+    }
+    return result;
+}
+
+std::optional<ObjectRayHit> Scene::segment_cast(glm::vec3 start, glm::vec3 end) const {
+    float length = glm::length(end - start);
+    if (length == 0.0f) return {};
+    return ray_cast(start, (end - start) / length, length);
+}
+
+std::vector<std::pair<const Object*, const BVHShapeCollider*>> Scene::bvh_colliders() const {
+    std::vector<std::pair<const Object*, const BVHShapeCollider*>> result;
+    std::unordered_set<const Collider*> seen;
+    for (auto& object : objects) {
+        auto collider = object->get_collider().get();
+        if (!collider || !collider->is_shape_collider()) continue;
+
+        auto& shape_collider = reinterpret_cast<const ShapeCollider&>(*collider);
+        if (!shape_collider.is_bvh_shape_collider()) continue;
+        if (!seen.insert(collider).second) continue;
+
+        result.emplace_back(object.get(), &reinterpret_cast<const BVHShapeCollider&>(shape_collider));
+    }
+    return result;
+}
+
+void Scene::dump_bvh_stats(std::ostream& out) const {
+    json colliders = json::array();
+    for (auto [object, collider] : bvh_colliders()) {
+        auto& bvh_collider = *collider;
+        auto stats = bvh_collider.bvh_stats();
+
+        const char* storage_names[] = { "pointers", "quantised_8", "quantised_16" };
+        colliders.push_back({
+            { "object", object->get_name() },
+            { "faces", bvh_collider.get_shape().get_faces().size() },
+            { "storage", storage_names[(size_t)bvh_collider.get_storage()] },
+            { "memory_bytes", bvh_collider.bvh_memory_usage() },
+            { "nodes", stats.node_count },
+            { "leaves", stats.leaf_count },
+            { "primitives", stats.primitive_count },
+            { "max_depth", stats.max_depth },
+            { "sah_cost", stats.sah_cost },
+            { "sibling_overlap", stats.sibling_overlap },
+            { "depth_histogram", stats.depth_histogram },
+            { "leaf_size_histogram", stats.leaf_size_histogram },
+        });
+    }
+
+    json result = {
+        { "colliders", colliders },
+        { "last_frame", {
+            { "queries", bvh_frame_stats.queries },
+            { "nodes_visited", bvh_frame_stats.nodes_visited },
+            { "leaves_tested", bvh_frame_stats.leaves_tested },
+        } },
+    };
+    out << result.dump(4) << std::endl;
+}
+
+BVHStats Scene::largest_bvh_stats() const {
+    const BVHShapeCollider* largest = nullptr;
+    for (auto [object, collider] : bvh_colliders()) {
+        if (!largest || collider->get_shape().get_faces().size() > largest->get_shape().get_faces().size()) largest = collider;
+    }
+    return largest ? largest->bvh_stats() : BVHStats();
+}
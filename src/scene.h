@@ -1,10 +1,38 @@
 #pragma once
 
 #include <array>
+#include <ostream>
+#include <functional>
+#include <unordered_map>
 
 #include "object.h"
 #include "constraint.h"
 #include "controller.h"
+#include "wide_contacts.h"
+#include "joint_tree.h"
+#include "xpbd.h"
+
+struct ObjectRayHit {
+    std::shared_ptr<Object> object;
+    float distance;
+    glm::vec3 point;
+    glm::vec3 normal;
+    const Face* face; // Only set for shape colliders
+    glm::vec3 barycentric;
+};
+
+struct IslandStats {
+    size_t islands = 0;
+    size_t sleeping = 0;
+    size_t largest = 0; // Objects in the largest island
+    size_t objects = 0; // Objects in all islands, static ones are never part of one
+};
+
+struct SolverStats {
+    size_t iterations = 0;       // Most done by any island
+    size_t total_iterations = 0; // Summed over all awake islands
+    float residual = 0.0f;       // Largest velocity error corrected in the last iteration of any island
+};
 
 class Scene {
     public:
@@ -20,13 +48,60 @@ class Scene {
 
         bool is_empty(AABB) const;
 
-        float baumgarte_bias = 0.2f;
-        float max_step_size = 1.0f / 180.0f;
-        size_t solver_steps = 8;
+        // Closest collider hit along a normalised direction, for picking and line of sight checks
+        std::optional<ObjectRayHit> ray_cast(glm::vec3 origin, glm::vec3 direction, float max_distance) const;
+        std::optional<ObjectRayHit> segment_cast(glm::vec3 start, glm::vec3 end) const;
+
+        // Writes the quality of every mesh collider's BVH and the last frame's traversal counts as JSON
+        void dump_bvh_stats(std::ostream& out) const;
+        // Quality of the BVH of the mesh collider with the most faces, empty if there is none.
+        // Walks the whole tree, so only call it when the colliders change.
+        BVHStats largest_bvh_stats() const;
+
+        enum class Backend {
+            IMPULSE, // Sequential impulses, solver_steps iterations per step
+            XPBD,    // Position based, xpbd_substeps substeps per step with a single iteration each
+        };
+        Backend backend = Backend::IMPULSE;
+        size_t xpbd_substeps = 4;
+        float xpbd_compliance = 0.0f; // Of joints and contacts, inverse stiffness in m/N
+
+        float baumgarte_bias = 0.2f; // Of rigid constraints, see Softness
+        Softness contact_softness;
+        // Position errors are corrected with separate velocities that only move the bodies for one step,
+        // instead of being added to the real velocities as a bias (which adds energy and makes stacks jitter)
+        bool split_impulse = false;
+        float max_step_size = 1.0f / 180.0f; // Collision detection runs once per step
+        // Contacts are also created for pairs that are still apart by less than they can close within a step,
+        // the solver only lets them close the gap. Keeps fast objects from tunnelling through thin geometry.
+        bool speculative_contacts = true;
+        size_t solver_steps = 8; // Most iterations per step, islands stop early once they have converged
+        // Temporal Gauss-Seidel: the solver splits each step into this many substeps that move the bodies in between,
+        // with solver_steps iterations each. Contacts are only found once per step, the position errors of all
+        // constraints follow the bodies to first order instead. Much cheaper than a smaller max_step_size.
+        size_t solver_substeps = 1;
+        float solver_tolerance = 1e-3f; // Residual (see Constraint::solve) below which an island has converged, 0 always does all
+        // Below this many constraints and contacts they are solved in order on one thread
+        static constexpr size_t PARALLEL_SOLVE_THRESHOLD = 512;
+        bool wide_contacts = true; // Above it, contacts are solved several at a time with SIMD
+        bool direct_joints = true; // Joints that form a tree (e.g. chains) are solved exactly rather than iteratively
+        bool warm_starting = true; // Contacts and joints start from the impulses they ended the previous step with
+        float warm_start_factor = 1.0f;
         bool debug_mode = false;
 
+        // Islands whose objects have all been slower than this for time_to_sleep stop being solved and moved
+        bool allow_sleeping = true;
+        float sleep_linear_velocity = 0.1f;
+        float sleep_angular_velocity = 0.2f;
+        float time_to_sleep = 0.5f;
+
         double tick = 0.0;
-        
+        BVHQueryStats bvh_frame_stats; // Traversal work done by the last update(float)
+        IslandStats island_stats;      // From the last step
+        SolverStats solver_stats;      // From the last step
+
+        // Hot state of the objects, declared before anything that can hold them so that it outlives them
+        BodyStorage body_storage;
         std::unique_ptr<Controller> controller = {};
 
         glm::vec3 camera_pos = glm::vec3(0.0f);
@@ -36,23 +111,101 @@ class Scene {
         
         glm::vec3 ambient_colour = glm::vec3(0.2f);
 
+        // Add and remove objects with add_object and remove_objects, which move them in and out of body_storage
         std::vector<std::shared_ptr<Object>> objects;
-        std::vector<std::unique_ptr<Constraint>> constraints;
+        // Joints of each type in one contiguous array, so that the solver goes over them without virtual calls.
+        // The islands point into them during a step, so only add or remove joints in between.
+        std::vector<BallSocketJoint> ball_socket_joints;
+        std::vector<HingeJoint> hinge_joints;
         std::vector<Light> lights;
         std::array<std::shared_ptr<Texture>, 6> skybox; // Same as OpenGL Cubemap format
 
         std::shared_ptr<Object> get_object(std::string);
+        void add_object(std::shared_ptr<Object>);
+        void remove_objects(const std::function<bool(const Object&)>& predicate);
 
         void clear();
     private:
+        // Every mesh collider with a BVH once (they are shared between objects using the same mesh), with the first object using it
+        std::vector<std::pair<const Object*, const BVHShapeCollider*>> bvh_colliders() const;
+
+        struct ObjectPairHash {
+            size_t operator()(const std::pair<const Object*, const Object*>& pair) const {
+                return std::hash<const Object*>()(pair.first) * 31 + std::hash<const Object*>()(pair.second);
+            }
+        };
+
         std::vector<ContactConstraint> contacts;
+        std::unordered_map<std::pair<const Object*, const Object*>, ContactCache, ObjectPairHash> contact_cache; // From the previous step
         float remaining_step = 0.0f;
 
+        // Objects connected by joints or contacts, static objects don't connect anything
+        struct Island {
+            std::vector<Object*> objects;
+            std::vector<BallSocketJoint*> ball_socket_joints;
+            std::vector<HingeJoint*> hinge_joints;
+            std::vector<ContactConstraint*> contacts;
+            bool sleeping = false;
+
+            size_t iterations = 0; // By the last solve
+            float residual = 0.0f;
+
+            // Split up after prepare, all joints are in either
+            std::vector<JointTree> joint_trees;
+            std::vector<BallSocketJoint*> iterative_ball_socket_joints;
+            std::vector<HingeJoint*> iterative_hinge_joints;
+
+            size_t joint_count() const { return ball_socket_joints.size() + hinge_joints.size(); }
+            // Calls f with every joint as its own type
+            template<typename F>
+            void for_each_joint(F&& f) const {
+                for (auto joint : ball_socket_joints) f(*joint);
+                for (auto joint : hinge_joints) f(*joint);
+            }
+        };
+        std::vector<Island> islands;
+        std::vector<SolverBody> solver_bodies; // One per object, in the same order, only used while solving
+        XPBDSolver xpbd;
+
+        // Constraints in the same batch never share a dynamic object. The overflow batch has to be solved in order.
+        struct SolverBatch {
+            std::vector<BallSocketJoint*> ball_socket_joints;
+            std::vector<HingeJoint*> hinge_joints;
+            std::vector<ContactConstraint*> narrow_contacts; // If they aren't solved wide
+            WideContactSolver contacts;
+
+            // Joints, narrow contacts and groups of wide contacts, in that order
+            size_t size() const { return ball_socket_joints.size() + hinge_joints.size() + narrow_contacts.size() + contacts.group_count(); }
+            // Solves the i-th of them once, like Constraint::solve
+            float solve(size_t i);
+        };
+        std::vector<SolverBatch> solver_batches;
+        std::vector<Constraint*> solver_overflow;
+
+        void build_islands(float step_size);
+        void colour_constraints(const Island&);
+        void solve_constraints(float step_size);
+        void solve_island(Island&, float step_size);
+        void warm_start_island(Island&);
+        void start_substep(Island&, float substep, bool first);
+        void split_joints(Island&);
+
+        // How far into what it hits an Object::ccd sphere is stopped, so that the next step finds the contact
+        static constexpr float CCD_DEPTH = 0.005f;
+        // Most impacts an Object::ccd sphere resolves within one step, it stops at the last one
+        static constexpr size_t CCD_MAX_IMPACTS = 4;
+        // Moves an Object::ccd sphere that went from start to its position in the last step back to where it first
+        // touched another collider on the way. There an impulse stops the two from moving into each other and the sphere
+        // moves on for the rest of the step, which can hit something else. Other objects are taken where they ended up,
+        // so two fast Object::ccd spheres can still pass through each other.
+        void sweep(Object&, glm::vec3 start, float step_size);
+
         void render_skybox() const;
         void light_pass(const Light& light) const;
         void ambient_pass(glm::vec3 colour) const;
 
-        void evaluate_contact(Object&, Object&);
-        void evaluate_contact(Object&, Object&, const SphereCollider&, const SphereCollider&);
-        void evaluate_contact(Object&, Object&, const ShapeCollider&, const SphereCollider&);
+        // Margin is how far apart the objects can be and still get a (speculative) contact
+        void evaluate_contact(Object&, Object&, float margin);
+        void evaluate_contact(Object&, Object&, const SphereCollider&, const SphereCollider&, float margin);
+        void evaluate_contact(Object&, Object&, const ShapeCollider&, const SphereCollider&, float margin);
 };
\ No newline at end of file
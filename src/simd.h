@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_SSE2
+#endif
+
+#undef min
+#undef max
+
+// A float per lane, 8 lanes with AVX2, 4 with SSE2 and otherwise 4 lanes of plain floats.
+// Only what the wide contact solver needs. Comparisons give masks with all bits set in the lanes where they hold,
+// mask & a keeps a in those lanes and and_not(mask, a) in the others (both are zero elsewhere).
+struct floatw {
+#if defined(SIMD_AVX2)
+    static constexpr size_t WIDTH = 8;
+    __m256 v;
+
+    floatw() : v(_mm256_setzero_ps()) {}
+    floatw(float f) : v(_mm256_set1_ps(f)) {}
+    floatw(__m256 v) : v(v) {}
+
+    static floatw load(const float* p) { return _mm256_loadu_ps(p); }
+    void store(float* p) const { _mm256_storeu_ps(p, v); }
+
+    floatw operator+(floatw o) const { return _mm256_add_ps(v, o.v); }
+    floatw operator-(floatw o) const { return _mm256_sub_ps(v, o.v); }
+    floatw operator*(floatw o) const { return _mm256_mul_ps(v, o.v); }
+    floatw operator-() const { return _mm256_sub_ps(_mm256_setzero_ps(), v); }
+
+    friend floatw min(floatw a, floatw b) { return _mm256_min_ps(a.v, b.v); }
+    friend floatw max(floatw a, floatw b) { return _mm256_max_ps(a.v, b.v); }
+
+    friend floatw operator<(floatw a, floatw b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+    friend floatw operator&(floatw mask, floatw a) { return _mm256_and_ps(mask.v, a.v); }
+    friend floatw and_not(floatw mask, floatw a) { return _mm256_andnot_ps(mask.v, a.v); }
+#elif defined(SIMD_SSE2)
+    static constexpr size_t WIDTH = 4;
+    __m128 v;
+
+    floatw() : v(_mm_setzero_ps()) {}
+    floatw(float f) : v(_mm_set1_ps(f)) {}
+    floatw(__m128 v) : v(v) {}
+
+    static floatw load(const float* p) { return _mm_loadu_ps(p); }
+    void store(float* p) const { _mm_storeu_ps(p, v); }
+
+    floatw operator+(floatw o) const { return _mm_add_ps(v, o.v); }
+    floatw operator-(floatw o) const { return _mm_sub_ps(v, o.v); }
+    floatw operator*(floatw o) const { return _mm_mul_ps(v, o.v); }
+    floatw operator-() const { return _mm_sub_ps(_mm_setzero_ps(), v); }
+
+    friend floatw min(floatw a, floatw b) { return _mm_min_ps(a.v, b.v); }
+    friend floatw max(floatw a, floatw b) { return _mm_max_ps(a.v, b.v); }
+
+    friend floatw operator<(floatw a, floatw b) { return _mm_cmplt_ps(a.v, b.v); }
+    friend floatw operator&(floatw mask, floatw a) { return _mm_and_ps(mask.v, a.v); }
+    friend floatw and_not(floatw mask, floatw a) { return _mm_andnot_ps(mask.v, a.v); }
+#else
+    static constexpr size_t WIDTH = 4;
+    float v[WIDTH];
+
+    floatw() : floatw(0.0f) {}
+    floatw(float f) { for (size_t i = 0; i<WIDTH; i++) v[i] = f; }
+
+    static floatw load(const float* p) { floatw r; for (size_t i = 0; i<WIDTH; i++) r.v[i] = p[i]; return r; }
+    void store(float* p) const { for (size_t i = 0; i<WIDTH; i++) p[i] = v[i]; }
+
+    #define FLOATW_OP(OP) floatw operator OP (floatw o) const { floatw r; for (size_t i = 0; i<WIDTH; i++) r.v[i] = v[i] OP o.v[i]; return r; }
+    FLOATW_OP(+)
+    FLOATW_OP(-)
+    FLOATW_OP(*)
+    #undef FLOATW_OP
+    floatw operator-() const { return floatw(0.0f) - *this; }
+
+    friend floatw min(floatw a, floatw b) { floatw r; for (size_t i = 0; i<WIDTH; i++) r.v[i] = std::min(a.v[i], b.v[i]); return r; }
+    friend floatw max(floatw a, floatw b) { floatw r; for (size_t i = 0; i<WIDTH; i++) r.v[i] = std::max(a.v[i], b.v[i]); return r; }
+
+    // Masks are kept as the bits of the floats, like in the SIMD registers
+    static float from_bits(uint32_t bits) { float f; std::memcpy(&f, &bits, sizeof(f)); return f; }
+    static uint32_t to_bits(float f) { uint32_t bits; std::memcpy(&bits, &f, sizeof(f)); return bits; }
+    friend floatw operator<(floatw a, floatw b) { floatw r; for (size_t i = 0; i<WIDTH; i++) r.v[i] = from_bits(a.v[i] < b.v[i] ? ~0u : 0u); return r; }
+    friend floatw operator&(floatw mask, floatw a) { floatw r; for (size_t i = 0; i<WIDTH; i++) r.v[i] = from_bits(to_bits(mask.v[i]) & to_bits(a.v[i])); return r; }
+    friend floatw and_not(floatw mask, floatw a) { floatw r; for (size_t i = 0; i<WIDTH; i++) r.v[i] = from_bits(~to_bits(mask.v[i]) & to_bits(a.v[i])); return r; }
+#endif
+
+    floatw& operator+=(floatw o) { return *this = *this + o; }
+    floatw& operator-=(floatw o) { return *this = *this - o; }
+
+    friend floatw abs(floatw a) { return max(a, -a); }
+    // Largest of the lanes
+    float reduce_max() const {
+        float lanes[WIDTH];
+        store(lanes);
+        float result = lanes[0];
+        for (size_t i = 1; i<WIDTH; i++) result = std::max(result, lanes[i]);
+        return result;
+    }
+};
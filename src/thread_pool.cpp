@@ -0,0 +1,85 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+static thread_local bool inside_job = false;
+
+ThreadPool::ThreadPool() {
+    size_t count = std::thread::hardware_concurrency();
+    if (count > 1) {
+        for (size_t i = 0; i<count - 1; i++) {
+            workers.emplace_back(&ThreadPool::worker_loop, this);
+        }
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    work_available.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::parallel_for(size_t count, size_t min_chunk, const std::function<void(size_t, size_t)>& func) {
+    if (count == 0) return;
+    min_chunk = std::max(min_chunk, (size_t)1);
+
+    if (workers.empty() || inside_job || count <= min_chunk) {
+        func(0, count);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+
+    job = &func;
+    job_count = count;
+    // A few chunks per thread so that uneven work still balances out
+    chunk_size = std::max(min_chunk, (count + size() * 4 - 1) / (size() * 4));
+    next_chunk = 0;
+    busy_workers = workers.size();
+    generation++;
+
+    lock.unlock();
+    work_available.notify_all();
+
+    inside_job = true;
+    run_chunks();
+    inside_job = false;
+
+    lock.lock();
+    work_done.wait(lock, [&]() { return busy_workers == 0; });
+    job = nullptr;
+}
+
+void ThreadPool::run_chunks() {
+    while (true) {
+        size_t begin = next_chunk.fetch_add(chunk_size);
+        if (begin >= job_count) break;
+
+        (*job)(begin, std::min(begin + chunk_size, job_count));
+    }
+}
+
+void ThreadPool::worker_loop() {
+    inside_job = true;
+
+    size_t seen_generation = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        work_available.wait(lock, [&]() { return stopping || generation != seen_generation; });
+        if (stopping) return;
+        seen_generation = generation;
+
+        lock.unlock();
+        run_chunks();
+        lock.lock();
+
+        if (--busy_workers == 0) {
+            work_done.notify_one();
+        }
+    }
+}
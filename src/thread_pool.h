@@ -0,0 +1,49 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+class ThreadPool {
+    public:
+        static ThreadPool& the() {
+            static ThreadPool instance;
+            return instance;
+        }
+
+        ThreadPool(ThreadPool const&) = delete;
+        void operator=(ThreadPool const&) = delete;
+
+        ~ThreadPool();
+
+        // Number of threads that take part in a parallel_for (including the calling thread)
+        size_t size() const { return workers.size() + 1; }
+
+        // Splits [0, count) into chunks of at least min_chunk and calls func(begin, end) for each of them.
+        // Blocks until every chunk is done. Nested calls from inside a job are run inline.
+        void parallel_for(size_t count, size_t min_chunk, const std::function<void(size_t, size_t)>& func);
+
+    private:
+        ThreadPool();
+
+        void worker_loop();
+        void run_chunks();
+
+        std::vector<std::thread> workers;
+
+        std::mutex mutex;
+        std::condition_variable work_available;
+        std::condition_variable work_done;
+
+        const std::function<void(size_t, size_t)>* job = nullptr;
+        size_t job_count = 0;
+        size_t chunk_size = 0;
+        std::atomic<size_t> next_chunk = { 0 };
+
+        size_t busy_workers = 0;
+        size_t generation = 0;
+        bool stopping = false;
+};
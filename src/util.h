@@ -106,6 +106,114 @@ inline glm::vec3 project_point_to_triangle(glm::vec3 point, const glm::vec3& tri
     return projected_point;
 }
 
+// Möller-Trumbore, works for both windings. barycentric holds the weights of tri_a, tri_b and tri_c at the hit
+inline bool intersect_ray_triangle(const glm::vec3& origin, const glm::vec3& direction, const glm::vec3& tri_a, const glm::vec3& tri_b, const glm::vec3& tri_c, float& distance, glm::vec3& barycentric) {
+    auto edge_ab = tri_b - tri_a;
+    auto edge_ac = tri_c - tri_a;
+
+    auto p = glm::cross(direction, edge_ac);
+    float det = glm::dot(edge_ab, p);
+    if (std::abs(det) < 1e-12f) return false; // Parallel to the triangle
+
+    float inv_det = 1.0f / det;
+    auto offset = origin - tri_a;
+
+    float u = glm::dot(offset, p) * inv_det;
+    if (u < 0.0f || u > 1.0f) return false;
+
+    auto q = glm::cross(offset, edge_ab);
+    float v = glm::dot(direction, q) * inv_det;
+    if (v < 0.0f || u + v > 1.0f) return false;
+
+    distance = glm::dot(edge_ac, q) * inv_det;
+    if (distance < 0.0f) return false;
+
+    barycentric = glm::vec3(1.0f - u - v, u, v);
+    return true;
+}
+
+// Swept sphere tests for continuous collision detection, the sphere's centre moves from origin to origin + motion.
+// If it first comes within radius of the primitive before t (a fraction of motion), t is lowered to when that happens
+// and normal is set to the direction from the primitive to the centre at that time.
+// Starting within radius already doesn't count as a hit.
+
+inline bool sweep_sphere_point(const glm::vec3& origin, const glm::vec3& motion, float radius, const glm::vec3& point, float& t, glm::vec3& normal) {
+    auto offset = origin - point;
+    float a = glm::dot(motion, motion);
+    float b = glm::dot(offset, motion);
+    float c = glm::dot(offset, offset) - radius * radius;
+    if (c <= 0.0f || b >= 0.0f) return false; // Inside or moving away
+
+    float discriminant = b * b - a * c;
+    if (discriminant < 0.0f) return false;
+
+    float hit = (-b - std::sqrt(discriminant)) / a;
+    if (hit >= t) return false;
+    t = hit;
+    normal = (offset + motion * hit) / radius;
+    return true;
+}
+
+// Only the side of the segment, its ends are left to sweep_sphere_point
+inline bool sweep_sphere_segment(const glm::vec3& origin, const glm::vec3& motion, float radius, const glm::vec3& line_a, const glm::vec3& line_b, float& t, glm::vec3& normal) {
+    auto dir = line_b - line_a;
+    float m = glm::dot(dir, dir);
+    auto offset = origin - line_a;
+    auto offset_perp = offset - dir * (glm::dot(offset, dir) / m);
+    auto motion_perp = motion - dir * (glm::dot(motion, dir) / m);
+
+    float a = glm::dot(motion_perp, motion_perp);
+    float b = glm::dot(offset_perp, motion_perp);
+    float c = glm::dot(offset_perp, offset_perp) - radius * radius;
+    if (c <= 0.0f || b >= 0.0f) return false;
+
+    float discriminant = b * b - a * c;
+    if (discriminant < 0.0f) return false;
+
+    float hit = (-b - std::sqrt(discriminant)) / a;
+    if (hit >= t) return false;
+    float v = glm::dot(offset + motion * hit, dir);
+    if (v < 0.0f || v > m) return false;
+    t = hit;
+    normal = (offset_perp + motion_perp * hit) / radius;
+    return true;
+}
+
+// Front side only, like the contacts against shapes. The face first, then its edges and corners.
+inline bool sweep_sphere_triangle(const glm::vec3& origin, const glm::vec3& motion, float radius, const glm::vec3& tri_a, const glm::vec3& tri_b, const glm::vec3& tri_c, float& t, glm::vec3& normal) {
+    auto face_normal = glm::cross(tri_b - tri_a, tri_c - tri_a);
+    float length = glm::length(face_normal);
+    if (length == 0.0f) return false;
+    face_normal /= length;
+
+    float dist = glm::dot(face_normal, origin - tri_a);
+    if (dist <= 0.0f) return false;
+
+    float speed = glm::dot(face_normal, motion);
+    if (dist > radius && speed < 0.0f) {
+        float hit = (dist - radius) / -speed;
+        if (hit >= t) return false; // Edges and corners can only be hit later
+
+        auto point = origin + motion * hit - face_normal * radius;
+        if (glm::dot(glm::cross(tri_b - tri_a, point - tri_a), face_normal) >= 0.0f &&
+            glm::dot(glm::cross(tri_c - tri_b, point - tri_b), face_normal) >= 0.0f &&
+            glm::dot(glm::cross(tri_a - tri_c, point - tri_c), face_normal) >= 0.0f) {
+            t = hit;
+            normal = face_normal;
+            return true;
+        }
+    }
+
+    bool hit = false;
+    hit |= sweep_sphere_segment(origin, motion, radius, tri_a, tri_b, t, normal);
+    hit |= sweep_sphere_segment(origin, motion, radius, tri_b, tri_c, t, normal);
+    hit |= sweep_sphere_segment(origin, motion, radius, tri_c, tri_a, t, normal);
+    hit |= sweep_sphere_point(origin, motion, radius, tri_a, t, normal);
+    hit |= sweep_sphere_point(origin, motion, radius, tri_b, t, normal);
+    hit |= sweep_sphere_point(origin, motion, radius, tri_c, t, normal);
+    return hit;
+}
+
 inline void glVertex(const glm::vec3& v) {
     glVertex3fv(&v.x);
 }
@@ -8,6 +8,16 @@
 #include <cstddef>
 #include <assert.h>
 
+// Bit masks of the 3 float blocks of a Jacobian row: linear A, angular A, linear B, angular B
+constexpr unsigned LINEAR_A_BLOCK  = 1;
+constexpr unsigned ANGULAR_A_BLOCK = 2;
+constexpr unsigned LINEAR_B_BLOCK  = 4;
+constexpr unsigned ANGULAR_B_BLOCK = 8;
+constexpr unsigned BODY_A_BLOCKS  = LINEAR_A_BLOCK | ANGULAR_A_BLOCK;
+constexpr unsigned BODY_B_BLOCKS  = LINEAR_B_BLOCK | ANGULAR_B_BLOCK;
+constexpr unsigned ANGULAR_BLOCKS = ANGULAR_A_BLOCK | ANGULAR_B_BLOCK;
+constexpr unsigned ALL_BLOCKS     = BODY_A_BLOCKS | BODY_B_BLOCKS;
+
 class vec12 {
 	public:
 		explicit constexpr vec12(float a, float b, float c, float d, float e, float f, float g, float h, float i, float j, float k, float l) : d{a,b,c,d,e,f,g,h,i,j,k,l} {}
@@ -52,6 +62,39 @@ class vec12 {
 			return result;
 		}
 
+		// Only the blocks in BLOCKS, the others are treated as zero and skipped at compile time
+		template<unsigned BLOCKS>
+		float constexpr sparse_dot(const vec12& other) const {
+			if constexpr (BLOCKS == ALL_BLOCKS) return dot(other);
+
+			float result = 0.0f;
+			if constexpr ((BLOCKS & LINEAR_A_BLOCK) != 0)  result += d[0]*other.d[0] + d[ 1]*other.d[ 1] + d[ 2]*other.d[ 2];
+			if constexpr ((BLOCKS & ANGULAR_A_BLOCK) != 0) result += d[3]*other.d[3] + d[ 4]*other.d[ 4] + d[ 5]*other.d[ 5];
+			if constexpr ((BLOCKS & LINEAR_B_BLOCK) != 0)  result += d[6]*other.d[6] + d[ 7]*other.d[ 7] + d[ 8]*other.d[ 8];
+			if constexpr ((BLOCKS & ANGULAR_B_BLOCK) != 0) result += d[9]*other.d[9] + d[10]*other.d[10] + d[11]*other.d[11];
+			return result;
+		}
+
+		template<unsigned BLOCKS>
+		void constexpr sparse_add(const vec12& other, const float factor) {
+			if constexpr (BLOCKS == ALL_BLOCKS) {
+				for (size_t i=0; i<12; i++) d[i] += other.d[i] * factor;
+				return;
+			}
+
+			if constexpr ((BLOCKS & LINEAR_A_BLOCK) != 0)  for (size_t i=0; i<3; i++)  d[i] += other.d[i] * factor;
+			if constexpr ((BLOCKS & ANGULAR_A_BLOCK) != 0) for (size_t i=3; i<6; i++)  d[i] += other.d[i] * factor;
+			if constexpr ((BLOCKS & LINEAR_B_BLOCK) != 0)  for (size_t i=6; i<9; i++)  d[i] += other.d[i] * factor;
+			if constexpr ((BLOCKS & ANGULAR_B_BLOCK) != 0) for (size_t i=9; i<12; i++) d[i] += other.d[i] * factor;
+		}
+
+		void constexpr clear_blocks(unsigned blocks) {
+			for (size_t block=0; block<4; block++) {
+				if (!(blocks & (1u << block))) continue;
+				for (size_t i=block*3; i<block*3+3; i++) d[i] = 0.0f;
+			}
+		}
+
 		#define SIMPLE_OP(OP) vec12 constexpr operator OP (const vec12& other) const {\
 			auto result = vec12();\
 			for (size_t i=0; i<12; i++) result.d[i] = d[i] OP other.d[i];\
@@ -0,0 +1,224 @@
+#include "wide_contacts.h"
+
+#include <algorithm>
+
+static floatw dot(const float (&J)[12][floatw::WIDTH], const floatw (&V)[12]) {
+    floatw result = floatw::load(J[0]) * V[0];
+    for (size_t i = 1; i<12; i++) result += floatw::load(J[i]) * V[i];
+    return result;
+}
+
+static void apply(const float (&MJ)[12][floatw::WIDTH], floatw (&V)[12], floatw lambda) {
+    for (size_t i = 0; i<12; i++) V[i] += floatw::load(MJ[i]) * lambda;
+}
+
+void WideContactSolver::add(ContactConstraint& contact) {
+    if (count % WIDTH == 0) groups.emplace_back();
+    auto& group = groups.back();
+    size_t lane = count++ % WIDTH;
+
+    group.contacts[lane] = &contact;
+    group.friction[lane] = contact.friction;
+    group.points = std::max(group.points, contact.contact_count);
+    group.block_solves[lane] = contact.block_solve ? 1.0f : 0.0f;
+    split_impulse = contact.split_impulse; // The same for all contacts of a step
+
+    for (size_t p = 0; p<contact.contact_count; p++) {
+        auto& point = contact.contacts[p];
+
+        auto& normal = point.normal_row;
+        for (size_t i = 0; i<12; i++) {
+            group.normals[p].J[i][lane] = normal.J[i];
+            group.normals[p].MJ[i][lane] = normal.MJ[i];
+        }
+        group.normal_masses[p][lane] = normal.inverse_effective_mass;
+        group.normal_responses[p][lane] = 1.0f / normal.inverse_effective_mass;
+        group.biases[p][lane] = normal.bias;
+        group.position_biases[p][lane] = normal.position_bias;
+        group.mass_scales[p][lane] = normal.soft.mass_scale;
+        group.impulse_scales[p][lane] = normal.soft.impulse_scale;
+        group.normal_impulses[p][lane] = contact.normal_impulse_sum[p];
+        if (contact.block_solve) {
+            for (size_t q = 0; q<contact.contact_count; q++) group.normal_block_masses[p][q][lane] = contact.normal_block_mass[p][q];
+        }
+
+        auto& tangents = point.tangent_rows;
+        for (size_t r = 0; r<2; r++) {
+            for (size_t i = 0; i<12; i++) {
+                group.tangents[p][r].J[i][lane] = tangents.J[r][i];
+                group.tangents[p][r].MJ[i][lane] = tangents.MJ[r][i];
+            }
+            group.tangent_impulses[p][r][lane] = point.tangent_impulse_sum[r];
+            group.tangent_responses[p][r][lane] = tangents.response[(glm::length_t)r];
+        }
+        for (size_t c = 0; c<2; c++) {
+            for (size_t r = 0; r<2; r++) {
+                group.tangent_masses[p][c * 2 + r][lane] = tangents.inverse_effective_mass[c][r];
+            }
+        }
+    }
+}
+
+float WideContactSolver::solve(size_t index) {
+    auto& group = groups[index];
+
+    // Gather
+    Lanes velocities[12] = {};
+    for (size_t lane = 0; lane<WIDTH; lane++) {
+        auto contact = group.contacts[lane];
+        if (!contact) continue;
+
+        auto v = combined_velocity_vector(*contact->body_a, *contact->body_b);
+        for (size_t i = 0; i<12; i++) velocities[i][lane] = v[i];
+    }
+    floatw V[12];
+    for (size_t i = 0; i<12; i++) V[i] = floatw::load(velocities[i]);
+
+    floatw residual;
+
+    // Normal component like ContactConstraint::solve_normals. Lanes with a block solve take it if it keeps all of their
+    // impulses positive, the others solve their points one after the other.
+    floatw error[POINTS];
+    for (size_t p = 0; p<group.points; p++) error[p] = -floatw::load(group.biases[p]) - dot(group.normals[p].J, V);
+
+    floatw block = floatw(0.0f) < floatw::load(group.block_solves);
+    floatw block_sums[POINTS];
+    for (size_t p = 0; p<group.points; p++) {
+        floatw lambda = floatw::load(group.normal_block_masses[p][0]) * error[0];
+        for (size_t q = 1; q<group.points; q++) lambda += floatw::load(group.normal_block_masses[p][q]) * error[q];
+
+        floatw previous = floatw::load(group.normal_impulses[p]);
+        block_sums[p] = previous + floatw::load(group.mass_scales[p]) * lambda - floatw::load(group.impulse_scales[p]) * previous;
+        block = and_not(block_sums[p] < floatw(0.0f), block);
+    }
+    for (size_t p = 0; p<group.points; p++) {
+        floatw previous = floatw::load(group.normal_impulses[p]);
+        floatw change = block & (block_sums[p] - previous);
+        apply(group.normals[p].MJ, V, change);
+        residual = max(residual, abs(change) * floatw::load(group.normal_responses[p]));
+        ((block & block_sums[p]) + and_not(block, previous)).store(group.normal_impulses[p]);
+    }
+
+    for (size_t p = 0; p<group.points; p++) {
+        auto& row = group.normals[p];
+        floatw previous = floatw::load(group.normal_impulses[p]);
+        floatw lambda = floatw::load(group.mass_scales[p]) * (floatw::load(group.normal_masses[p]) * (-floatw::load(group.biases[p]) - dot(row.J, V)))
+            - floatw::load(group.impulse_scales[p]) * previous;
+
+        floatw impulse_sum = max(previous + lambda, floatw(0.0f));
+        floatw change = and_not(block, impulse_sum - previous);
+        apply(row.MJ, V, change);
+        residual = max(residual, abs(change) * floatw::load(group.normal_responses[p]));
+        ((block & previous) + and_not(block, impulse_sum)).store(group.normal_impulses[p]);
+    }
+
+    // Friction component
+    floatw friction = floatw::load(group.friction);
+    for (size_t p = 0; p<group.points; p++) {
+        auto& rows = group.tangents[p];
+        auto& K = group.tangent_masses[p];
+
+        floatw error_0 = -dot(rows[0].J, V);
+        floatw error_1 = -dot(rows[1].J, V);
+        floatw lambda_0 = floatw::load(K[0]) * error_0 + floatw::load(K[2]) * error_1;
+        floatw lambda_1 = floatw::load(K[1]) * error_0 + floatw::load(K[3]) * error_1;
+
+        floatw maximum = floatw::load(group.normal_impulses[p]) * friction;
+        floatw previous_0 = floatw::load(group.tangent_impulses[p][0]);
+        floatw previous_1 = floatw::load(group.tangent_impulses[p][1]);
+        floatw impulse_0 = max(min(previous_0 + lambda_0, maximum), -maximum);
+        floatw impulse_1 = max(min(previous_1 + lambda_1, maximum), -maximum);
+
+        apply(rows[0].MJ, V, impulse_0 - previous_0);
+        apply(rows[1].MJ, V, impulse_1 - previous_1);
+        residual = max(residual, abs(impulse_0 - previous_0) * floatw::load(group.tangent_responses[p][0]));
+        residual = max(residual, abs(impulse_1 - previous_1) * floatw::load(group.tangent_responses[p][1]));
+        impulse_0.store(group.tangent_impulses[p][0]);
+        impulse_1.store(group.tangent_impulses[p][1]);
+    }
+
+    // Scatter, set_velocity skips static bodies
+    for (size_t i = 0; i<12; i++) V[i].store(velocities[i]);
+    for (size_t lane = 0; lane<WIDTH; lane++) {
+        auto contact = group.contacts[lane];
+        if (!contact) continue;
+
+        vec12 v;
+        for (size_t i = 0; i<12; i++) v[i] = velocities[i][lane];
+        set_velocity(*contact->body_a, *contact->body_b, v);
+    }
+    if (split_impulse) residual = max(residual, solve_split(group));
+    return residual.reduce_max();
+}
+
+// Like the normal component of solve, for the split velocities and against the position biases
+floatw WideContactSolver::solve_split(Group& group) {
+    Lanes velocities[12] = {};
+    for (size_t lane = 0; lane<WIDTH; lane++) {
+        auto contact = group.contacts[lane];
+        if (!contact) continue;
+
+        auto v = combined_split_velocity_vector(*contact->body_a, *contact->body_b);
+        for (size_t i = 0; i<12; i++) velocities[i][lane] = v[i];
+    }
+    floatw V[12];
+    for (size_t i = 0; i<12; i++) V[i] = floatw::load(velocities[i]);
+
+    floatw residual;
+    for (size_t p = 0; p<group.points; p++) {
+        auto& row = group.normals[p];
+        floatw lambda = floatw::load(group.normal_masses[p]) * (-floatw::load(group.position_biases[p]) - dot(row.J, V));
+
+        floatw previous = floatw::load(group.split_impulses[p]);
+        floatw impulse_sum = max(previous + lambda, floatw(0.0f));
+        apply(row.MJ, V, impulse_sum - previous);
+        residual = max(residual, abs(impulse_sum - previous) * floatw::load(group.normal_responses[p]));
+        impulse_sum.store(group.split_impulses[p]);
+    }
+
+    for (size_t i = 0; i<12; i++) V[i].store(velocities[i]);
+    for (size_t lane = 0; lane<WIDTH; lane++) {
+        auto contact = group.contacts[lane];
+        if (!contact) continue;
+
+        vec12 v;
+        for (size_t i = 0; i<12; i++) v[i] = velocities[i][lane];
+        set_split_velocity(*contact->body_a, *contact->body_b, v);
+    }
+    return residual;
+}
+
+void WideContactSolver::store_impulses() const {
+    for (auto& group : groups) {
+        for (size_t lane = 0; lane<WIDTH; lane++) {
+            auto contact = group.contacts[lane];
+            if (!contact) continue;
+
+            for (size_t p = 0; p<contact->contact_count; p++) {
+                contact->normal_impulse_sum[p] = group.normal_impulses[p][lane];
+                contact->contacts[p].tangent_impulse_sum = glm::vec2(group.tangent_impulses[p][0][lane], group.tangent_impulses[p][1][lane]);
+            }
+        }
+    }
+}
+
+void WideContactSolver::reload() {
+    for (auto& group : groups) {
+        for (size_t lane = 0; lane<WIDTH; lane++) {
+            auto contact = group.contacts[lane];
+            if (!contact) continue;
+
+            for (size_t p = 0; p<contact->contact_count; p++) {
+                auto& point = contact->contacts[p];
+                group.biases[p][lane] = point.normal_row.bias;
+                group.position_biases[p][lane] = point.normal_row.position_bias;
+                group.mass_scales[p][lane] = point.normal_row.soft.mass_scale;
+                group.impulse_scales[p][lane] = point.normal_row.soft.impulse_scale;
+                group.normal_impulses[p][lane] = contact->normal_impulse_sum[p];
+                group.split_impulses[p][lane] = 0.0f;
+                group.tangent_impulses[p][0][lane] = point.tangent_impulse_sum.x;
+                group.tangent_impulses[p][1][lane] = point.tangent_impulse_sum.y;
+            }
+        }
+    }
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <vector>
+
+#include "simd.h"
+#include "constraint.h"
+
+// Solves contacts floatw::WIDTH at a time, with the prepared rows of each contact packed into struct-of-arrays lanes.
+// The dynamic objects of all contacts added to one solver have to be unique (e.g. the contacts of one colour batch),
+// static ones can be shared since they are never written to.
+class WideContactSolver {
+    public:
+        static constexpr size_t WIDTH = floatw::WIDTH;
+
+        void clear() { groups.clear(); count = 0; split_impulse = false; }
+        // Packs the prepared rows and the current (warm started) impulses of the contact
+        void add(ContactConstraint& contact);
+
+        size_t size() const { return count; }
+        size_t group_count() const { return groups.size(); }
+
+        // A single solver iteration of one group of contacts, groups share no dynamic objects so they can run in parallel.
+        // Returns the largest velocity error corrected, like Constraint::solve.
+        float solve(size_t group);
+        // Hands the accumulated impulses back to the contacts, so that they can be cached for the next step
+        void store_impulses() const;
+        // Takes over the contacts' biases, softness and impulses again, after they were advanced to the next substep
+        void reload();
+
+    private:
+        // Struct-of-arrays, every value has one float per lane
+        typedef float Lanes[WIDTH];
+
+        struct Row {
+            Lanes J[12];
+            Lanes MJ[12];
+        };
+
+        static constexpr size_t POINTS = ContactConstraint::MAX_CONTACTS;
+
+        // Lanes without a contact, or points beyond a contact's own, have all zero rows and masses and never change anything
+        struct Group {
+            ContactConstraint* contacts[WIDTH] = {};
+            size_t points = 0; // Most of any contact in the group, only those are solved
+
+            Row normals[POINTS] = {};
+            Lanes normal_masses[POINTS] = {};
+            Lanes normal_responses[POINTS] = {}; // Rows' J * M * J^T, for the residual
+            Lanes biases[POINTS] = {};
+            Lanes normal_impulses[POINTS] = {};
+            Lanes normal_block_masses[POINTS][POINTS] = {}; // ContactConstraint::normal_block_mass
+            Lanes block_solves = {}; // 1 for contacts with a block solve (see ContactConstraint::solve_normals), else 0
+            Lanes position_biases[POINTS] = {};
+            Lanes mass_scales[POINTS] = {}; // SoftCoefficients, they differ between speculative and overlapping points
+            Lanes impulse_scales[POINTS] = {};
+            Lanes split_impulses[POINTS] = {}; // Start at zero every step
+
+            Row tangents[POINTS][2] = {};
+            Lanes tangent_masses[POINTS][4] = {}; // 2x2 inverse effective mass of each point, column major
+            Lanes tangent_responses[POINTS][2] = {};
+            Lanes tangent_impulses[POINTS][2] = {};
+
+            Lanes friction = {};
+        };
+
+        std::vector<Group> groups;
+        size_t count = 0;
+        bool split_impulse = false;
+
+        floatw solve_split(Group& group);
+};
@@ -0,0 +1,234 @@
+#include "xpbd.h"
+
+#include "scene.h"
+
+#undef min
+#undef max
+
+float XPBDSolver::Body::inverse_mass(glm::vec3 r, glm::vec3 n) const {
+    if (is_static) return 0.0f;
+    glm::vec3 rn = glm::cross(r, n);
+    return inv_mass + glm::dot(rn, inverse_inertia_times(rn));
+}
+
+void XPBDSolver::Body::apply_correction(glm::vec3 p, glm::vec3 r) {
+    if (is_static) return;
+    position += p * inv_mass;
+    apply_rotation(glm::cross(r, p));
+}
+
+// Angular impulse p, the first order quaternion update is renormalised right away
+void XPBDSolver::Body::apply_rotation(glm::vec3 p) {
+    if (is_static) return;
+    glm::vec3 w = inverse_inertia_times(p);
+    orientation = glm::normalize(orientation + 0.5f * glm::quat(0.0f, w) * orientation);
+}
+
+void XPBDSolver::Body::apply_impulse(glm::vec3 p, glm::vec3 r) {
+    if (is_static) return;
+    linear_velocity += p * inv_mass;
+    angular_velocity += inverse_inertia_times(glm::cross(r, p));
+}
+
+float XPBDSolver::correct_position(Body& a, Body& b, glm::vec3 r_a, glm::vec3 r_b, glm::vec3 correction, float compliance) {
+    float c = glm::length(correction);
+    if (c == 0.0f) return 0.0f;
+    glm::vec3 n = correction / c;
+
+    float w = a.inverse_mass(r_a, n) + b.inverse_mass(r_b, n);
+    if (w + compliance == 0.0f) return 0.0f;
+    float lambda = c / (w + compliance);
+
+    a.apply_correction(-lambda * n, r_a);
+    b.apply_correction(lambda * n, r_b);
+    return lambda;
+}
+
+void XPBDSolver::correct_rotation(Body& a, Body& b, glm::vec3 rotation, float compliance) {
+    float angle = glm::length(rotation);
+    if (angle == 0.0f) return;
+    glm::vec3 n = rotation / angle;
+
+    float w = a.angular_inverse_mass(n) + b.angular_inverse_mass(n);
+    if (w + compliance == 0.0f) return;
+    float lambda = angle / (w + compliance);
+
+    a.apply_rotation(-lambda * n);
+    b.apply_rotation(lambda * n);
+}
+
+// One iteration per substep, so the accumulated multipliers of the paper are always zero and drop out
+void XPBDSolver::solve_joint(const Joint& joint, float compliance) {
+    auto& a = *joint.a;
+    auto& b = *joint.b;
+
+    if (joint.hinge) { // Align the axes first, rotating b's onto a's
+        glm::vec3 axis_a = a.orientation * joint.local_vec_a;
+        glm::vec3 axis_b = b.orientation * joint.local_vec_b;
+        correct_rotation(a, b, glm::cross(axis_b, axis_a), compliance);
+    }
+
+    glm::vec3 r_a = a.orientation * joint.local_a;
+    glm::vec3 r_b = b.orientation * joint.local_b;
+    correct_position(a, b, r_a, r_b, (a.position + r_a) - (b.position + r_b), compliance);
+}
+
+void XPBDSolver::solve_contact(Contact& contact, float compliance) {
+    auto& a = *contact.a;
+    auto& b = *contact.b;
+    contact.normal_lambda = 0.0f;
+
+    glm::vec3 r_a = a.orientation * contact.local_a;
+    glm::vec3 r_b = b.orientation * contact.local_b;
+    float depth = glm::dot((b.position + r_b) - (a.position + r_a), contact.normal) + CONTACT_SLOP;
+    if (depth >= 0.0f) return;
+
+    contact.normal_lambda = correct_position(a, b, r_a, r_b, -depth * contact.normal, compliance);
+
+    // Static friction undoes the tangential slip of the substep, unless that would take more than friction allows
+    glm::vec3 previous_a = a.previous_position + a.previous_orientation * contact.local_a;
+    glm::vec3 previous_b = b.previous_position + b.previous_orientation * contact.local_b;
+    r_a = a.orientation * contact.local_a;
+    r_b = b.orientation * contact.local_b;
+    glm::vec3 slip = ((b.position + r_b) - previous_b) - ((a.position + r_a) - previous_a);
+    slip -= contact.normal * glm::dot(slip, contact.normal);
+
+    float length = glm::length(slip);
+    if (length == 0.0f) return;
+    glm::vec3 t = slip / length;
+    float w = a.inverse_mass(r_a, t) + b.inverse_mass(r_b, t);
+    if (w == 0.0f || length / w > contact.friction * contact.normal_lambda) return;
+    correct_position(a, b, r_a, r_b, -slip, 0.0f);
+}
+
+// The normal velocity that the position correction left is removed, and dynamic friction takes away
+// as much of the sliding velocity as the normal impulse of the substep allows. Restitution isn't
+// applied, like with the impulse solver.
+void XPBDSolver::solve_contact_velocity(const Contact& contact, float substep) {
+    if (contact.normal_lambda == 0.0f) return;
+    auto& a = *contact.a;
+    auto& b = *contact.b;
+
+    glm::vec3 r_a = a.orientation * contact.local_a;
+    glm::vec3 r_b = b.orientation * contact.local_b;
+    glm::vec3 n = contact.normal;
+
+    float normal_velocity = glm::dot(b.point_velocity(r_b) - a.point_velocity(r_a), n);
+    float w = a.inverse_mass(r_a, n) + b.inverse_mass(r_b, n);
+    if (w == 0.0f) return;
+    a.apply_impulse(n * (normal_velocity / w), r_a);
+    b.apply_impulse(n * (-normal_velocity / w), r_b);
+
+    glm::vec3 velocity = b.point_velocity(r_b) - a.point_velocity(r_a);
+    glm::vec3 tangent_velocity = velocity - n * glm::dot(velocity, n);
+    float speed = glm::length(tangent_velocity);
+    if (speed == 0.0f) return;
+    glm::vec3 t = tangent_velocity / speed;
+    w = a.inverse_mass(r_a, t) + b.inverse_mass(r_b, t);
+
+    float impulse = std::min(speed / w, contact.friction * contact.normal_lambda / substep);
+    a.apply_impulse(t * impulse, r_a);
+    b.apply_impulse(-t * impulse, r_b);
+}
+
+void XPBDSolver::step(Scene& scene, const std::vector<ContactConstraint>& scene_contacts, float step_size) {
+    auto& storage = scene.body_storage;
+
+    bodies.resize(storage.size());
+    for (size_t i = 0; i<storage.size(); i++) {
+        auto& body = bodies[i];
+
+        body.position = storage.positions[i];
+        body.orientation = storage.orientations[i];
+        body.linear_velocity = storage.linear_velocities[i];
+        body.angular_velocity = storage.angular_velocities[i];
+        body.local_inverse_inertia = storage.local_inverse_inertias[i];
+        body.inv_mass = storage.inv_masses[i];
+        body.is_static = storage.is_static(i);
+    }
+
+    joints.clear();
+    for (auto& ball : scene.ball_socket_joints) {
+        Joint joint;
+        joint.a = &bodies[ball.get_object_a().get_body()];
+        joint.b = &bodies[ball.get_object_b().get_body()];
+        joint.local_a = ball.local_a;
+        joint.local_b = ball.local_b;
+        joint.hinge = false;
+        if (joint.a->is_static && joint.b->is_static) continue;
+        joints.push_back(joint);
+    }
+    for (auto& hinge : scene.hinge_joints) {
+        Joint joint;
+        joint.a = &bodies[hinge.get_object_a().get_body()];
+        joint.b = &bodies[hinge.get_object_b().get_body()];
+        joint.local_a = hinge.local_a;
+        joint.local_b = hinge.local_b;
+        joint.local_vec_a = hinge.local_vec_a;
+        joint.local_vec_b = hinge.local_vec_b;
+        joint.hinge = true;
+        if (joint.a->is_static && joint.b->is_static) continue;
+        joints.push_back(joint);
+    }
+
+    contacts.clear();
+    for (auto& constraint : scene_contacts) {
+        auto& obj_a = constraint.get_object_a();
+        auto& obj_b = constraint.get_object_b();
+        for (size_t i = 0; i<constraint.contact_count; i++) {
+            auto& point = constraint.contacts[i];
+
+            Contact contact;
+            contact.a = &bodies[obj_a.get_body()];
+            contact.b = &bodies[obj_b.get_body()];
+            contact.local_a = point.anchor;
+            contact.local_b = obj_b.global_to_local_vec(point.offsets[1]);
+            contact.normal = point.normal;
+            contact.friction = std::sqrt(obj_a.friction * obj_b.friction);
+            contact.normal_lambda = 0.0f;
+            contacts.push_back(contact);
+        }
+    }
+
+    float substep = step_size / scene.xpbd_substeps;
+    float compliance = scene.xpbd_compliance / (substep * substep);
+    for (size_t s = 0; s<scene.xpbd_substeps; s++) {
+        // Static objects can still be moved by their velocity, but nothing ever pushes them
+        for (auto& body : bodies) {
+            body.previous_position = body.position;
+            body.previous_orientation = body.orientation;
+
+            if (body.inv_mass != 0.0f) body.linear_velocity += scene.gravity * substep;
+            body.position += body.linear_velocity * substep;
+            body.orientation = glm::normalize(body.orientation + 0.5f * substep * glm::quat(0.0f, body.angular_velocity) * body.orientation);
+
+            glm::mat3 rotation = glm::mat3_cast(body.orientation);
+            body.inverse_inertia = rotation * body.local_inverse_inertia * glm::transpose(rotation);
+        }
+
+        for (auto& joint : joints) solve_joint(joint, compliance);
+        for (auto& contact : contacts) solve_contact(contact, compliance);
+
+        for (auto& body : bodies) {
+            if (body.is_static) continue;
+            body.linear_velocity = (body.position - body.previous_position) / substep;
+            glm::quat delta = body.orientation * glm::conjugate(body.previous_orientation);
+            body.angular_velocity = (delta.w >= 0.0f ? 2.0f : -2.0f) / substep * glm::vec3(delta.x, delta.y, delta.z);
+        }
+
+        for (auto& contact : contacts) solve_contact_velocity(contact, substep);
+    }
+
+    for (size_t i = 0; i<storage.size(); i++) {
+        auto& object = *storage.objects[i];
+        auto& body = bodies[i];
+
+        object.position() = body.position;
+        object.orientation() = body.orientation;
+        object.linear_velocity() = body.linear_velocity;
+        object.angular_velocity() = body.angular_velocity;
+        object.set_sleeping(false);
+        object.update_orientation();
+        object.update_transform();
+    }
+}
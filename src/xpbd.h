@@ -0,0 +1,80 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/gtc/quaternion.hpp>
+
+#include "constraint.h"
+
+class Scene;
+
+// Extended position based dynamics (Müller et al., "Detailed Rigid Body Simulation with Extended Position Based Dynamics"),
+// the alternative to the impulse solver selected with Scene::backend. Every step is split into Scene::xpbd_substeps
+// substeps that each integrate the objects, project the joints and contacts once and derive the velocities from how far
+// the objects moved. Contacts are still only found once per step, their points are kept in the objects' local spaces.
+class XPBDSolver {
+    public:
+        // Moves all objects of the scene by one step, contacts have to be the ones found for their current positions
+        void step(Scene& scene, const std::vector<ContactConstraint>& contacts, float step_size);
+
+    private:
+        // Contacts are only pushed apart until they overlap by this much. Resting ones would otherwise end up
+        // exactly touching, and be missed by the collision detection at the start of the next step every so often.
+        static constexpr float CONTACT_SLOP = 0.002f;
+
+        struct Body {
+            glm::vec3 position;
+            glm::vec3 previous_position; // At the start of the substep
+            glm::quat orientation;
+            glm::quat previous_orientation;
+            glm::vec3 linear_velocity;
+            glm::vec3 angular_velocity;
+            glm::mat3 local_inverse_inertia;
+            glm::mat3 inverse_inertia; // Global space, only updated once per substep since the corrections are small
+            float inv_mass;
+            bool is_static;
+
+            glm::vec3 inverse_inertia_times(glm::vec3 v) const { return inverse_inertia * v; }
+            // Of a correction along the normalised direction n at offset r
+            float inverse_mass(glm::vec3 r, glm::vec3 n) const;
+            float angular_inverse_mass(glm::vec3 n) const { return is_static ? 0.0f : glm::dot(n, inverse_inertia_times(n)); }
+
+            void apply_correction(glm::vec3 p, glm::vec3 r);
+            void apply_rotation(glm::vec3 p);
+            void apply_impulse(glm::vec3 p, glm::vec3 r);
+            glm::vec3 point_velocity(glm::vec3 r) const { return linear_velocity + glm::cross(angular_velocity, r); }
+        };
+
+        struct Joint {
+            Body* a;
+            Body* b;
+            glm::vec3 local_a; // Anchors
+            glm::vec3 local_b;
+            bool hinge;
+            glm::vec3 local_vec_a; // Hinge axes
+            glm::vec3 local_vec_b;
+        };
+
+        struct Contact {
+            Body* a;
+            Body* b;
+            glm::vec3 local_a;
+            glm::vec3 local_b;
+            glm::vec3 normal; // From A to B, fixed for the step
+            float friction;
+            float normal_lambda; // Of the current substep, 0 if the points were apart
+        };
+
+        std::vector<Body> bodies; // One per object, in the same order
+        std::vector<Joint> joints;
+        std::vector<Contact> contacts;
+
+        // Moves b by correction relative to a, returns the magnitude of the positional impulse
+        static float correct_position(Body& a, Body& b, glm::vec3 r_a, glm::vec3 r_b, glm::vec3 correction, float compliance);
+        // Rotates b by rotation (axis times angle) relative to a
+        static void correct_rotation(Body& a, Body& b, glm::vec3 rotation, float compliance);
+
+        void solve_joint(const Joint&, float compliance);
+        void solve_contact(Contact&, float compliance);
+        void solve_contact_velocity(const Contact&, float substep);
+};